@@ -0,0 +1,195 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2008 Alexandru Dreptu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Helper for cscan-bench.sh.
+ *
+ *   benchtool listen -o <ports> [-f <ports>]
+ *       Listen on 0.0.0.0 for every port in -o and accept/close whatever
+ *       comes in. Ports in -f get a listener with a full accept queue that
+ *       is never drained, so SYNs to them are dropped and the probe times
+ *       out like a filtered port. Prints "ready" once everything is set up
+ *       and runs until killed.
+ *
+ *   benchtool run <file> <cmd> [args...]
+ *       Run a command and write "<elapsed ms> <user ms> <sys ms> <max rss kb>"
+ *       to file once it exits.
+ *
+ * Compiling: gcc -Wall -std=gnu11 benchtool.c -o benchtool
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_PORTS 4096
+#define FILL_CONNS 8
+
+int open_ports[MAX_PORTS], filt_ports[MAX_PORTS];
+int open_nr = 0, filt_nr = 0;
+
+void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+// append "a-b" or "a" to list
+void add_ports(int *list, int *nr, const char *range) {
+    const char *dash = strchr(range, '-');
+    int first = atoi(range), last = dash ? atoi(dash + 1) : first;
+
+    if ((first < 1) || (first > last) || (last > 65535)) {
+        fprintf(stderr, "Invalid port range `%s'\n", range);
+        exit(EXIT_FAILURE);
+    }
+    for (; first <= last; first++) {
+        if (*nr == MAX_PORTS) {
+            fprintf(stderr, "Max %d ports\n", MAX_PORTS);
+            exit(EXIT_FAILURE);
+        }
+        list[(*nr)++] = first;
+    }
+}
+
+int listen_on(int port, int backlog) {
+    struct sockaddr_in addr;
+    int sock, on = 1;
+
+    if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+        die("socket()");
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) die("bind()");
+    if (listen(sock, backlog) == -1) die("listen()");
+    return sock;
+}
+
+// connect to ourselves until the accept queue is full
+void fill_queue(int port) {
+    struct sockaddr_in addr;
+    int i, sock;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (i = 0; i < FILL_CONNS; i++) {
+        if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+            die("socket()");
+        connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+        // leak it, the queue has to stay full
+    }
+}
+
+int do_listen(int argc, char *argv[]) {
+    struct epoll_event ev, events[256];
+    int i, n, x, epfd, sock;
+
+    while ((x = getopt(argc, argv, "o:f:")) != -1) {
+        switch (x) {
+        case 'o': add_ports(open_ports, &open_nr, optarg); break;
+        case 'f': add_ports(filt_ports, &filt_nr, optarg); break;
+        default: exit(EXIT_FAILURE);
+        }
+    }
+
+    if ((epfd = epoll_create1(0)) == -1) die("epoll_create1()");
+    for (i = 0; i < open_nr; i++) {
+        ev.events = EPOLLIN;
+        ev.data.fd = listen_on(open_ports[i], SOMAXCONN);
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) == -1)
+            die("epoll_ctl()");
+    }
+    for (i = 0; i < filt_nr; i++) {
+        listen_on(filt_ports[i], 0);
+        fill_queue(filt_ports[i]);
+    }
+    // let the handshakes of the fillers land in the queues
+    usleep(200000);
+    printf("ready\n");
+    fflush(stdout);
+
+    for (;;) {
+        if ((n = epoll_wait(epfd, events, 256, -1)) == -1) {
+            if (errno == EINTR) continue;
+            die("epoll_wait()");
+        }
+        for (i = 0; i < n; i++)
+            while ((sock = accept(events[i].data.fd, NULL, NULL)) != -1)
+                close(sock);
+    }
+}
+
+long ms_since(struct timespec *t0) {
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) * 1000 + (t1.tv_nsec - t0->tv_nsec) / 1000000;
+}
+
+int do_run(int argc, char *argv[]) {
+    struct timespec t0;
+    struct rusage ru;
+    int status;
+    pid_t pid;
+    FILE *fp;
+
+    if (!(fp = fopen(argv[1], "w"))) die(argv[1]);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if ((pid = fork()) == -1) die("fork()");
+    if (!pid) {
+        execvp(argv[2], argv + 2);
+        die(argv[2]);
+    }
+    if (wait4(pid, &status, 0, &ru) == -1) die("wait4()");
+    fprintf(fp, "%ld %ld %ld %ld\n", ms_since(&t0),
+            ru.ru_utime.tv_sec * 1000 + ru.ru_utime.tv_usec / 1000,
+            ru.ru_stime.tv_sec * 1000 + ru.ru_stime.tv_usec / 1000,
+            ru.ru_maxrss);
+    fclose(fp);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[]) {
+    if ((argc > 1) && !strcmp(argv[1], "listen"))
+        return do_listen(argc - 1, argv + 1);
+    if ((argc > 3) && !strcmp(argv[1], "run")) return do_run(argc - 1, argv + 1);
+    fprintf(stderr, "Usage: %s listen -o <ports> [-f <ports>]\n"
+                    "       %s run <file> <cmd> [args...]\n",
+            argv[0], argv[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,181 @@
+#!/bin/sh
+#
+# Throughput benchmark for cscan.
+#
+# Builds cscan from this tree and runs it inside a private network namespace
+# against 10.77.0.0/<n>, which is routed locally so every address answers
+# without per address setup. Every host has the same port layout, starting
+# at the base port: open ports (a listener accepts), then closed ports
+# (nothing listens, RST) and then filtered ports (the SYN is dropped). The
+# result is checked against that layout and probes/sec, accuracy, CPU time
+# and peak RSS are reported. Exits with 1 if accuracy is below -A.
+#
+# With -S the range is routed to cscan-sim on a TUN device instead, and the
+# open/closed/filtered mix, RTTs and loss come from the simulator options
+# given to -S. Use it for large ranges, e.g. -n 12 -S "-O 2 -r 5-80 -l 1".
+#
+# Needs root (or unprivileged user namespaces), gcc and iproute2; -D also
+# needs the sch_netem module and -S needs /dev/net/tun.
+#
+# Usage: bench/cscan-bench.sh [options] [-- cscan options]
+#
+
+set -e
+
+bits=22
+base=20000
+open_nr=4
+closed_nr=2
+filt_nr=2
+delay=0
+timeout=1
+sockets=1000
+min_acc=100
+keep=""
+sim=${CSCAN_BENCH_SIM-}
+
+usage() {
+    cat <<USAGE
+
+  Usage: $0 [options] [-- cscan options]
+
+  Options:
+    -n <n>   Scan 10.77.0.0/<n> [default $bits]
+    -P <n>   Base port [default $base]
+    -O <n>   Open ports per host [default $open_nr]
+    -C <n>   Closed ports per host [default $closed_nr]
+    -F <n>   Filtered ports per host [default $filt_nr]
+    -D <n>   Extra delay in ms on every packet (netem) [default $delay]
+    -t <n>   cscan timeout [default $timeout]
+    -s <n>   cscan sockets [default $sockets]
+    -A <n>   Minimum accuracy in percent [default $min_acc]
+    -k <dir> Keep the build and scan output in <dir>
+    -S <str> Scan cscan-sim with these options, -O/-C/-F set the port count
+
+USAGE
+    exit 0
+}
+
+while getopts "n:P:O:C:F:D:t:s:A:k:S:h" x; do
+    case $x in
+    n) bits=$OPTARG ;;
+    P) base=$OPTARG ;;
+    O) open_nr=$OPTARG ;;
+    C) closed_nr=$OPTARG ;;
+    F) filt_nr=$OPTARG ;;
+    D) delay=$OPTARG ;;
+    t) timeout=$OPTARG ;;
+    s) sockets=$OPTARG ;;
+    A) min_acc=$OPTARG ;;
+    k) keep=$OPTARG ;;
+    S) sim=$OPTARG ;;
+    *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+# everything below runs in a fresh network namespace
+if [ -z "$CSCAN_BENCH_NS" ]; then
+    export CSCAN_BENCH_NS=1 CSCAN_BENCH_SIM="$sim"
+    args="-n $bits -P $base -O $open_nr -C $closed_nr -F $filt_nr -D $delay"
+    args="$args -t $timeout -s $sockets -A $min_acc"
+    [ -n "$keep" ] && args="$args -k $keep"
+    if [ "$(id -u)" = 0 ]; then
+        exec unshare -n "$0" $args -- "$@"
+    else
+        exec unshare -rn "$0" $args -- "$@"
+    fi
+fi
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+if [ -n "$keep" ]; then
+    dir=$keep
+    mkdir -p "$dir"
+else
+    dir=$(mktemp -d)
+    trap 'rm -rf "$dir"' EXIT
+fi
+
+gcc -O2 -Wall -std=gnu11 -pthread "$src/cscan.c" "$src/libcscan.c" "$src/libcscan-replay.c" -o "$dir/cscan"
+gcc -O2 -Wall -std=gnu11 "$src/bench/benchtool.c" -o "$dir/benchtool"
+gcc -O2 -Wall -std=gnu11 -I"$src" "$src/bench/cscan-sim.c" -o "$dir/cscan-sim"
+
+ip link set lo up
+if [ "$delay" -gt 0 ]; then
+    tc qdisc add dev lo root netem delay "${delay}ms"
+fi
+
+hosts=$((1 << (32 - bits)))
+ports=$((open_nr + closed_nr + filt_nr))
+last=$((base + ports - 1))
+probes=$((hosts * ports))
+closed_at=$((base + open_nr))
+filt_at=$((closed_at + closed_nr))
+
+if [ -n "$sim" ]; then
+    "$dir/cscan-sim" -i cscansim0 $sim >"$dir/listen.out" 2>"$dir/sim.out" &
+    lpid=$!
+else
+    ip route add local 10.77.0.0/"$bits" dev lo
+    lst=""
+    [ "$open_nr" -gt 0 ] && lst="-o $base-$((closed_at - 1))"
+    [ "$filt_nr" -gt 0 ] && lst="$lst -f $filt_at-$last"
+    "$dir/benchtool" listen $lst >"$dir/listen.out" &
+    lpid=$!
+fi
+trap 'kill $lpid 2>/dev/null; [ -z "$keep" ] && rm -rf "$dir"' EXIT
+while ! grep -q ready "$dir/listen.out" 2>/dev/null; do
+    kill -0 $lpid || exit 1
+    sleep 0.1
+done
+
+if [ -n "$sim" ]; then
+    ip addr add 192.168.77.1/32 dev cscansim0
+    ip link set cscansim0 up
+    ip route add 10.77.0.0/"$bits" dev cscansim0
+    echo "Scanning $hosts hosts x $ports ports on cscan-sim $sim"
+else
+    echo "Scanning $hosts hosts x $ports ports ($open_nr open," \
+         "$closed_nr closed, $filt_nr filtered), delay ${delay}ms"
+fi
+"$dir/benchtool" run "$dir/run.out" "$dir/cscan" -h 10.77.0.0/"$bits" -p "$base-$last" \
+    -t "$timeout" -s "$sockets" -a -o "$dir/scan.out" "$@" \
+    >"$dir/cscan.out" 2>&1 || {
+    tail -n 5 "$dir/cscan.out" >&2
+    exit 1
+}
+
+awk -v probes=$probes '{
+    printf "Probes %d in %.2fs, %.0f probes/sec\n", probes, $1 / 1000,
+           $1 ? probes * 1000 / $1 : 0
+    printf "CPU user %.2fs, sys %.2fs, %.1f us per probe\n", $2 / 1000,
+           $3 / 1000, ($2 + $3) * 1000 / probes
+    printf "Peak RSS %d kB\n", $4
+}' "$dir/run.out"
+
+if [ -n "$sim" ]; then
+    "$dir/cscan-sim" $sim -C "$dir/scan.out" -h 10.77.0.0/"$bits" \
+        -p "$base-$last" | tee "$dir/check.out"
+    exit $(awk -v min_acc=$min_acc '{ sub("%", "", $2); print ($2 < min_acc) }' \
+        "$dir/check.out")
+fi
+
+awk -v base=$base -v closed_at=$closed_at -v filt_at=$filt_at \
+    -v hosts=$hosts -v open_nr=$open_nr -v closed_nr=$closed_nr \
+    -v filt_nr=$filt_nr -v probes=$probes -v min_acc=$min_acc '
+{
+    split($1, a, ":")
+    if (seen[$1]++) next
+    want = (a[2] < closed_at) ? "open" : (a[2] < filt_at) ? "closed" : "filtered"
+    if ($2 == want) good[want]++
+    else wrong++
+    found++
+}
+END {
+    acc = probes ? (good["open"] + good["closed"] + good["filtered"]) * 100 / probes : 100
+    printf "Accuracy %.2f%% (open %d/%d, closed %d/%d, filtered %d/%d," \
+           " wrong %d, missing %d)\n", acc,
+           good["open"], hosts * open_nr, good["closed"], hosts * closed_nr,
+           good["filtered"], hosts * filt_nr, wrong, probes - found
+    exit (acc < min_acc)
+}' "$dir/scan.out"
@@ -0,0 +1,503 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2008 Alexandru Dreptu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Simulated network for load testing cscan.
+ *
+ * Attaches to a TUN device and answers TCP SYNs for any address routed to
+ * it. Every host and port gets a fixed fate from a hash of (seed, ip,
+ * port): open (SYN-ACK), closed (RST) or filtered (no answer), and a share
+ * of hosts can be down altogether. Replies are held back by a per host
+ * RTT plus jitter, SYNs can be lost at random and each host can be rate
+ * limited. No state is kept per host or connection, so memory use is the
+ * same for a /24 and a /8.
+ *
+ * Setup (as root):
+ *     ./cscan-sim -i sim0 &
+ *     ip addr add 192.168.77.1/32 dev sim0
+ *     ip link set sim0 up
+ *     ip route add 10.0.0.0/8 dev sim0
+ *     ./cscan -h 10.0.0.0/8 -p 80 -a -o scan.log
+ *     ./cscan-sim -C scan.log -h 10.0.0.0/8 -p 80
+ *
+ * The last line checks a scan against the model and prints its accuracy;
+ * give it the same model options (-S, -O, -c, -A) as the running simulator.
+ *
+ * Compiling: gcc -O2 -Wall -std=gnu11 -I.. cscan-sim.c -o cscan-sim
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cscan.h"
+
+#define BATCH 256
+#define WHEEL 8192 // ms, longest RTT
+#define BUCKETS 65536
+#define MSS 1460
+
+// fate of a probe
+#define SIM_OPEN 0
+#define SIM_CLOSED 1
+#define SIM_FILTERED 2
+#define SIM_DOWN 3
+
+// TCP flags
+#define F_FIN 0x01
+#define F_SYN 0x02
+#define F_RST 0x04
+#define F_ACK 0x10
+
+struct reply {
+    uint32_t src, dst; // network byte order
+    uint16_t sport, dport;
+    uint32_t seq, ack;
+    uint8_t flags;
+    uint32_t next; // index + 1, 0 = end
+};
+
+// model, fractions in 1/10000
+uint64_t seed = 0;
+unsigned int open_bp = 500, closed_bp = 4500, alive_bp = 10000;
+unsigned int rtt_min = 0, rtt_max = 0, jitter = 0;
+unsigned int loss_bp = 0;
+unsigned int host_pps = 0;
+
+// delayed replies, a timing wheel with 1 ms slots over a fixed pool
+struct reply *pool;
+uint32_t pool_nr = 1 << 20, pool_free = 0;
+uint32_t wheel[WHEEL];
+uint64_t wheel_ms;
+
+// per host rate limit: hashed GCRA buckets, theoretical arrival time in us
+uint64_t tat[BUCKETS];
+
+struct {
+    unsigned long packets, syns, synacks, rsts, filtered, down, lost, limited;
+    unsigned long queue_full, ignored;
+} st;
+
+int tun_fd;
+volatile sig_atomic_t stop = 0;
+
+uint64_t now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// ip in host byte order
+int fate(uint32_t ip, unsigned int port) {
+    unsigned int r;
+
+    if (alive_bp < 10000 &&
+        cscan_mix64(seed ^ 0x5bd1e995ULL ^ ((uint64_t)ip << 20)) % 10000 >= alive_bp)
+        return SIM_DOWN;
+    r = cscan_mix64(seed ^ ((uint64_t)ip << 16) ^ port) % 10000;
+    if (r < open_bp) return SIM_OPEN;
+    if (r < open_bp + closed_bp) return SIM_CLOSED;
+    return SIM_FILTERED;
+}
+
+unsigned int host_rtt(uint32_t ip) {
+    unsigned int rtt = rtt_min;
+
+    if (rtt_max > rtt_min)
+        rtt += cscan_mix64(seed ^ 0xc2b2ae35ULL ^ ip) % (rtt_max - rtt_min + 1);
+    if (jitter) rtt += random() % (jitter + 1);
+    return (rtt < WHEEL) ? rtt : WHEEL - 1;
+}
+
+int rate_ok(uint32_t ip, uint64_t now) {
+    uint64_t *t = &tat[cscan_mix64(ip) % BUCKETS];
+    uint64_t interval = 1000000 / host_pps;
+
+    // allow a burst of one second worth of packets
+    if (*t > now + 1000000) return 0;
+    *t = ((*t > now) ? *t : now) + interval;
+    return 1;
+}
+
+uint16_t csum_add(uint32_t sum, const void *data, int len) {
+    const uint8_t *p = data;
+
+    for (; len > 1; len -= 2, p += 2) sum += (p[0] << 8) | p[1];
+    if (len) sum += p[0] << 8;
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+void send_reply(struct reply *r) {
+    uint8_t pkt[44];
+    int len = (r->flags & F_SYN) ? 44 : 40;
+    uint32_t sum;
+    uint16_t c;
+
+    memset(pkt, 0, sizeof(pkt));
+    pkt[0] = 0x45;
+    pkt[2] = len >> 8;
+    pkt[3] = len;
+    pkt[8] = 64;
+    pkt[9] = IPPROTO_TCP;
+    memcpy(pkt + 12, &r->src, 4);
+    memcpy(pkt + 16, &r->dst, 4);
+    c = ~csum_add(0, pkt, 20);
+    pkt[10] = c >> 8;
+    pkt[11] = c;
+
+    memcpy(pkt + 20, &r->sport, 2);
+    memcpy(pkt + 22, &r->dport, 2);
+    r->seq = htonl(r->seq);
+    r->ack = htonl(r->ack);
+    memcpy(pkt + 24, &r->seq, 4);
+    memcpy(pkt + 28, &r->ack, 4);
+    pkt[32] = ((len - 20) / 4) << 4;
+    pkt[33] = r->flags;
+    if (r->flags & F_SYN) {
+        pkt[34] = 0xff; // window
+        pkt[35] = 0xff;
+        pkt[40] = 2; // MSS option
+        pkt[41] = 4;
+        pkt[42] = MSS >> 8;
+        pkt[43] = MSS & 0xff;
+    }
+    // pseudo header: addresses, protocol and TCP length
+    sum = csum_add(IPPROTO_TCP + len - 20, pkt + 12, 8);
+    c = ~csum_add(sum, pkt + 20, len - 20);
+    pkt[36] = c >> 8;
+    pkt[37] = c;
+
+    if (write(tun_fd, pkt, len) == len) {
+        if (r->flags & F_SYN) st.synacks++;
+        else st.rsts++;
+    }
+}
+
+void queue_reply(struct reply *r, unsigned int delay) {
+    uint32_t i, slot;
+
+    if (!delay) {
+        send_reply(r);
+        return;
+    }
+    if (!pool_free) {
+        st.queue_full++;
+        return;
+    }
+    i = pool_free - 1;
+    pool_free = pool[i].next;
+    pool[i] = *r;
+    slot = (wheel_ms + delay) % WHEEL;
+    pool[i].next = wheel[slot];
+    wheel[slot] = i + 1;
+}
+
+void run_wheel(uint64_t now_ms) {
+    uint32_t i, n, steps = 0;
+
+    while (wheel_ms < now_ms && steps++ < WHEEL) {
+        wheel_ms++;
+        i = wheel[wheel_ms % WHEEL];
+        wheel[wheel_ms % WHEEL] = 0;
+        while (i) {
+            n = pool[i - 1].next;
+            send_reply(&pool[i - 1]);
+            pool[i - 1].next = pool_free;
+            pool_free = i;
+            i = n;
+        }
+    }
+    wheel_ms = now_ms;
+}
+
+void handle(uint8_t *pkt, int len, uint64_t now) {
+    struct reply r;
+    uint32_t dst, seq, ack;
+    uint16_t dport;
+    uint8_t flags;
+    int ihl;
+
+    st.packets++;
+    if ((len < 20) || ((pkt[0] >> 4) != 4) || (pkt[9] != IPPROTO_TCP)) {
+        st.ignored++;
+        return;
+    }
+    ihl = (pkt[0] & 0x0f) * 4;
+    if (len < ihl + 20) {
+        st.ignored++;
+        return;
+    }
+    memcpy(&dst, pkt + 16, 4);
+    memcpy(&dport, pkt + ihl + 2, 2);
+    memcpy(&seq, pkt + ihl + 4, 4);
+    memcpy(&ack, pkt + ihl + 8, 4);
+    seq = ntohl(seq);
+    ack = ntohl(ack);
+    flags = pkt[ihl + 13];
+
+    memset(&r, 0, sizeof(r));
+    r.src = dst;
+    memcpy(&r.dst, pkt + 12, 4);
+    r.sport = dport;
+    memcpy(&r.dport, pkt + ihl, 2);
+
+    if ((flags & (F_SYN | F_ACK)) != F_SYN) {
+        // no connection state here, so reset anything closing or sending
+        // data and let bare ACKs pass
+        if ((flags & F_RST) ||
+            (!(flags & F_FIN) && (len <= ihl + (pkt[ihl + 12] >> 4) * 4)))
+            return;
+        r.seq = ack;
+        r.flags = F_RST;
+        send_reply(&r);
+        return;
+    }
+
+    st.syns++;
+    switch (fate(ntohl(dst), ntohs(dport))) {
+    case SIM_DOWN: st.down++; return;
+    case SIM_FILTERED: st.filtered++; return;
+    case SIM_OPEN:
+        r.seq = cscan_mix64(seed ^ ((uint64_t)dst << 16) ^ dport ^ seq);
+        r.ack = seq + 1;
+        r.flags = F_SYN | F_ACK;
+        break;
+    case SIM_CLOSED:
+        r.ack = seq + 1;
+        r.flags = F_RST | F_ACK;
+        break;
+    }
+    if (loss_bp && (random() % 10000 < loss_bp)) {
+        st.lost++;
+        return;
+    }
+    if (host_pps && !rate_ok(ntohl(dst), now)) {
+        st.limited++;
+        return;
+    }
+    queue_reply(&r, host_rtt(ntohl(dst)));
+}
+
+void print_stats(void) {
+    fprintf(stderr,
+            "Packets %lu, SYNs %lu: SYN-ACK %lu, RST %lu, filtered %lu,"
+            " down %lu, lost %lu, rate limited %lu, queue full %lu\n",
+            st.packets, st.syns, st.synacks, st.rsts, st.filtered, st.down,
+            st.lost, st.limited, st.queue_full);
+}
+
+void on_signal(int sig) { stop = 1; }
+
+int tun_open(const char *name) {
+    struct ifreq ifr;
+    int fd;
+
+    if ((fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK)) == -1) {
+        perror("Cannot open /dev/net/tun");
+        exit(EXIT_FAILURE);
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    snprintf(ifr.ifr_name, IFNAMSIZ, "%s", name);
+    if (ioctl(fd, TUNSETIFF, &ifr) == -1) {
+        perror("TUNSETIFF");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+// compare a cscan -a log with the model
+int check(const char *file, const char *hosts, const char *ports) {
+    static const char *names[] = {"open", "closed", "filtered", "filtered"};
+    unsigned long want[3] = {0}, good[3] = {0}, wrong = 0, lines = 0, total;
+    uint32_t ip, first, last;
+    unsigned int port, pfirst, plast, bits = 32;
+    char line[256], *colon, *slash, buf[64];
+    struct in_addr addr;
+    FILE *fp;
+    int f, i;
+
+    snprintf(buf, sizeof(buf), "%s", hosts);
+    if ((slash = strchr(buf, '/'))) {
+        *slash++ = 0;
+        bits = atoi(slash);
+    }
+    if (!inet_aton(buf, &addr) || (bits > 32)) {
+        fprintf(stderr, "Invalid host range `%s'\n", hosts);
+        return EXIT_FAILURE;
+    }
+    first = ntohl(addr.s_addr);
+    last = first | (bits ? (uint32_t)(0xffffffffULL >> bits) : 0xffffffff);
+    pfirst = atoi(ports);
+    plast = strchr(ports, '-') ? atoi(strchr(ports, '-') + 1) : pfirst;
+
+    for (ip = first;; ip++) {
+        for (port = pfirst; port <= plast; port++) {
+            f = fate(ip, port);
+            want[(f == SIM_DOWN) ? SIM_FILTERED : f]++;
+        }
+        if (ip == last) break;
+    }
+
+    if (!(fp = fopen(file, "r"))) {
+        perror(file);
+        return EXIT_FAILURE;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (!(colon = strchr(line, ':'))) continue;
+        *colon++ = 0;
+        if (!inet_aton(line, &addr)) continue;
+        port = strtoul(colon, &colon, 10);
+        while (*colon == ' ') colon++;
+        colon[strcspn(colon, " ")] = 0; // the state, not what follows it
+        lines++;
+        f = fate(ntohl(addr.s_addr), port);
+        if (!*colon) colon = "open"; // a log without -a
+        if (!strcmp(colon, names[f])) good[(f == SIM_DOWN) ? SIM_FILTERED : f]++;
+        else wrong++;
+    }
+    fclose(fp);
+
+    total = want[0] + want[1] + want[2];
+    printf("Accuracy %.2f%% (", total ? (good[0] + good[1] + good[2]) * 100.0 / total : 100.0);
+    for (i = 0; i < 3; i++)
+        printf("%s %lu/%lu, ", names[i], good[i], want[i]);
+    printf("wrong %lu, missing %lu)\n", wrong, (lines < total) ? total - lines : 0);
+    return 0;
+}
+
+void usage(char *this) {
+    printf("\n"
+           "  Simulated network for cscan\n"
+           "\n"
+           "  Usage: %s [options]\n"
+           "         %s -C <scan log> -h <ip[/n]> -p <port[-port]> [model]\n"
+           "\n"
+           "  Model:\n"
+           "    -S <n>   Seed [default 0]\n"
+           "    -O <n>   Open ports in %% [default 5]\n"
+           "    -c <n>   Closed ports in %%, the rest is filtered [default 45]\n"
+           "    -A <n>   Hosts up in %% [default 100]\n"
+           "\n"
+           "  Network:\n"
+           "    -i <n>   TUN device [default cscansim0]\n"
+           "    -r <n>   RTT in ms, min[-max] per host [default 0]\n"
+           "    -j <n>   Extra random delay per reply in ms [default 0]\n"
+           "    -l <n>   SYN loss in %% [default 0]\n"
+           "    -L <n>   Max SYNs/sec per host, 0 = off [default 0]\n"
+           "    -q <n>   Max delayed replies [default %u]\n"
+           "    -v       Print stats every second\n"
+           "\n",
+           this, this, pool_nr);
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    char dev[IFNAMSIZ] = "cscansim0", *check_file = NULL, *hosts = NULL,
+         *ports = NULL, *dash;
+    static uint8_t pkt[BATCH][2048];
+    int lens[BATCH];
+    uint64_t now, last_stats = 0;
+    struct pollfd pfd;
+    int i, n, x, verbose = 0;
+
+    while ((x = getopt(argc, argv, "S:O:c:A:i:r:j:l:L:q:C:h:p:v")) != -1) {
+        switch (x) {
+        case 'S': seed = strtoull(optarg, NULL, 0); break;
+        case 'O': open_bp = atof(optarg) * 100; break;
+        case 'c': closed_bp = atof(optarg) * 100; break;
+        case 'A': alive_bp = atof(optarg) * 100; break;
+        case 'i': snprintf(dev, sizeof(dev), "%s", optarg); break;
+        case 'r':
+            rtt_min = rtt_max = atoi(optarg);
+            if ((dash = strchr(optarg, '-'))) rtt_max = atoi(dash + 1);
+            break;
+        case 'j': jitter = atoi(optarg); break;
+        case 'l': loss_bp = atof(optarg) * 100; break;
+        case 'L': host_pps = atoi(optarg); break;
+        case 'q': pool_nr = atoi(optarg); break;
+        case 'C': check_file = optarg; break;
+        case 'h': hosts = optarg; break;
+        case 'p': ports = optarg; break;
+        case 'v': verbose = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if ((open_bp + closed_bp > 10000) || (alive_bp > 10000) ||
+        (rtt_max < rtt_min) || (rtt_max >= WHEEL) || !pool_nr) {
+        printf("Invalid model, try `%s -?' for usage.\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (check_file) {
+        if (!hosts || !ports) usage(argv[0]);
+        return check(check_file, hosts, ports);
+    }
+
+    if (!(pool = calloc(pool_nr, sizeof(struct reply)))) {
+        perror("Cannot allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < pool_nr; i++) pool[i].next = (i + 1 < pool_nr) ? i + 2 : 0;
+    pool_free = 1;
+
+    tun_fd = tun_open(dev);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    srandom(seed);
+    wheel_ms = now_us() / 1000;
+    printf("ready %s\n", dev);
+    fflush(stdout);
+
+    pfd.fd = tun_fd;
+    pfd.events = POLLIN;
+    while (!stop) {
+        // wake up every ms while replies are waiting
+        poll(&pfd, 1, (pool_free == 1 && !rtt_max && !jitter) ? 1000 : 1);
+        now = now_us();
+        for (n = 0; n < BATCH; n++)
+            if ((lens[n] = read(tun_fd, pkt[n], sizeof(pkt[n]))) <= 0) break;
+        for (i = 0; i < n; i++) handle(pkt[i], lens[i], now);
+        run_wheel(now / 1000);
+        if (verbose && (now - last_stats >= 1000000)) {
+            print_stats();
+            last_stats = now;
+        }
+    }
+    print_stats();
+    return 0;
+}
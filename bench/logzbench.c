@@ -0,0 +1,311 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2008 Alexandru Dreptu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Bytes written and CPU time of the plain text output against --compress,
+ * for a made up result stream shaped like an Internet scan: addresses in
+ * order, ten common ports each, mostly filtered, a few percent open, noisy
+ * RTTs and a mix of service banners. The text side formats lines as
+ * cscan's log_result() does and writes them in 64 KB batches; the
+ * compressed side is split into what the scan loop pays (encoding records)
+ * and what the writer thread pays (compressing and writing). Everything
+ * runs on one thread here so the CPU times are the bench's own.
+ *
+ * Compiling: gcc -O2 -Wall -std=gnu11 -I.. logzbench.c -o logzbench
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cscan-log.h"
+
+#define BATCH 65536
+
+const char *states[] = {"open", "closed", "filtered", "unreachable", "error"};
+const unsigned int ports[] = {21, 22, 23, 25, 80, 443, 3306, 3389, 8080, 8443};
+
+// %d is filled with a random number
+const char *banners[] = {
+    "SSH-2.0-OpenSSH_8.%dp1 Ubuntu-3ubuntu0.%d",
+    "SSH-2.0-OpenSSH_7.%d",
+    "SSH-2.0-dropbear_2022.%d",
+    "220 mail%d.example.net ESMTP Postfix (Debian/GNU)",
+    "220 (vsFTPd 3.0.%d)",
+    "220 ProFTPD Server (ProFTPD) [10.%d.0.1]",
+    "HTTP/1.1 200 OK Server: nginx/1.%d.0",
+    "HTTP/1.1 301 Moved Permanently Server: Apache/2.4.%d (Unix)",
+    "HTTP/1.1 404 Not Found Server: Microsoft-IIS/%d.0",
+    "HTTP/1.0 401 Unauthorized Server: RomPager/4.%d",
+    "5.7.%d-MariaDB-log",
+    "\\x03\\x00\\x00\\x13\\x0e\\xd0\\x00\\x00\\x12\\x34\\x00\\x02\\x%02x",
+};
+#define BANNERS_NR (sizeof(banners) / sizeof(banners[0]))
+
+struct result {
+    uint32_t ip;
+    unsigned int port, outcome;
+    unsigned long rtt_us;
+    char info[LOGZ_INFO_MAX + 1];
+};
+
+struct result *res;
+unsigned long res_nr;
+uint64_t rng = 88172645463325252ULL;
+
+uint64_t xorshift(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+double cpu_sec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// what -a, --rtt and --probe would write for n results
+void generate(unsigned long n, int all, int rtt, int banner) {
+    uint32_t ip = 0x0a000000;
+    unsigned int i = 0, r;
+
+    res_nr = 0;
+    while (res_nr < n) {
+        r = xorshift() % 1000;
+        res[res_nr].ip = ip;
+        res[res_nr].port = ports[i];
+        res[res_nr].outcome = (r < 30) ? 0 : (r < 150) ? 1 : (r < 155) ? 3 : 2;
+        res[res_nr].rtt_us = rtt ? 8000 + xorshift() % 250000 : 0;
+        res[res_nr].info[0] = 0;
+        if (banner && !res[res_nr].outcome) {
+            r = xorshift();
+            snprintf(res[res_nr].info, sizeof(res[res_nr].info),
+                     banners[r % BANNERS_NR], (r >> 8) % 32, (r >> 16) % 16);
+        }
+        if (all || !res[res_nr].outcome) res_nr++;
+        if (++i == sizeof(ports) / sizeof(ports[0])) {
+            i = 0;
+            ip += 1 + xorshift() % 3; // dead and dropped hosts leave gaps
+        }
+    }
+}
+
+// the text log, returns the bytes written
+unsigned long text(FILE *fp, int all, int rtt) {
+    static char buf[BATCH];
+    unsigned long i, total = 0;
+    size_t len = 0;
+    char *p;
+    int b;
+
+    for (i = 0; i < res_nr; i++) {
+        if (len > BATCH - 256) {
+            fwrite(buf, 1, len, fp);
+            total += len;
+            len = 0;
+        }
+        p = buf + len;
+        for (b = 24; b >= 0; b -= 8) {
+            p += sprintf(p, "%u", (res[i].ip >> b) & 0xff);
+            *p++ = b ? '.' : ':';
+        }
+        p += sprintf(p, "%u", res[i].port);
+        if (all) p += sprintf(p, " %s", states[res[i].outcome]);
+        if (rtt && res[i].rtt_us) p += sprintf(p, " %luus", res[i].rtt_us);
+        if (*res[i].info) p += sprintf(p, " %.160s", res[i].info);
+        *p++ = '\n';
+        len = p - buf;
+    }
+    fwrite(buf, 1, len, fp);
+    fflush(fp);
+    return total + len;
+}
+
+// records into blocks, the scan loop's part; returns the block count
+unsigned long encode(unsigned char (*blocks)[LOGZ_BLOCK], uint32_t *lens,
+                     int all, int rtt) {
+    struct logz_rec r = {0};
+    unsigned long i, nr = 0;
+    uint32_t prev = 0, len = 0;
+
+    for (i = 0; i < res_nr; i++) {
+        if (len > LOGZ_BLOCK - LOGZ_REC_MAX) {
+            lens[nr++] = len;
+            len = 0;
+            prev = 0;
+        }
+        r.ip = res[i].ip;
+        r.port = res[i].port;
+        r.outcome = res[i].outcome;
+        r.rtt_us = res[i].rtt_us;
+        r.flags = all ? LOGZ_STATE : 0;
+        if (rtt && r.rtt_us) r.flags |= LOGZ_RTT;
+        r.info = res[i].info;
+        r.info_len = strlen(res[i].info);
+        if (r.info_len) r.flags |= LOGZ_INFO;
+        len = logz_put(blocks[nr] + len, &prev, &r) - blocks[nr];
+    }
+    lens[nr++] = len;
+    return nr;
+}
+
+// the writer thread's part, returns the bytes written
+unsigned long compress(FILE *fp, unsigned char (*blocks)[LOGZ_BLOCK],
+                       uint32_t *lens, unsigned long nr) {
+    static unsigned char out[LOGZ_BOUND(LOGZ_BLOCK)];
+    unsigned long i, total = 8;
+    struct logz_block b;
+
+    fwrite(LOGZ_MAGIC, 8, 1, fp);
+    for (i = 0; i < nr; i++) {
+        b.raw_len = lens[i];
+        b.len = logz_compress(blocks[i], b.raw_len, out);
+        if (b.len >= b.raw_len) b.len = b.raw_len;
+        fwrite(&b, sizeof(b), 1, fp);
+        fwrite((b.len == b.raw_len) ? blocks[i] : out, 1, b.len, fp);
+        total += sizeof(b) + b.len;
+    }
+    fflush(fp);
+    return total;
+}
+
+// read it all back, returns the record count or 0 if it did not match
+unsigned long check(FILE *fp) {
+    static unsigned char raw[LOGZ_BLOCK], data[LOGZ_BOUND(LOGZ_BLOCK)];
+    const unsigned char *p, *end;
+    unsigned long nr = 0;
+    struct logz_block b;
+    struct logz_rec r;
+    uint32_t prev;
+    long n;
+
+    fseek(fp, 8, SEEK_SET);
+    while (fread(&b, sizeof(b), 1, fp) == 1) {
+        if (fread(data, 1, b.len, fp) != b.len) return 0;
+        if (b.len == b.raw_len)
+            memcpy(raw, data, n = b.len);
+        else if ((n = logz_decompress(data, b.len, raw, b.raw_len)) != b.raw_len)
+            return 0;
+        for (p = raw, end = raw + n, prev = 0; p < end; nr++) {
+            if (!(p = logz_get(p, end, &prev, &r)) || (nr >= res_nr) ||
+                (r.ip != res[nr].ip) || (r.port != res[nr].port) ||
+                (r.info_len != strlen(res[nr].info)))
+                return 0;
+        }
+    }
+    return nr;
+}
+
+void usage(char *this) {
+    printf("\n"
+           "  Usage: %s [options]\n"
+           "\n"
+           "  Options:\n"
+           "    -n <n>   Results per case [default 2000000]\n"
+           "    -f <n>   Scratch file [default logzbench.out]\n"
+           "\n",
+           this);
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    const struct {
+        const char *name;
+        int all, rtt, banner;
+    } cases[] = {
+        {"open", 0, 0, 0},
+        {"-a", 1, 0, 0},
+        {"-a --rtt", 1, 1, 0},
+        {"--probe banner", 0, 0, 1},
+    };
+    unsigned char (*blocks)[LOGZ_BLOCK];
+    unsigned long n = 2000000, nr, text_bytes, z_bytes;
+    double t, text_cpu, enc_cpu, z_cpu, dec_cpu;
+    const char *path = "logzbench.out";
+    uint32_t *lens;
+    unsigned int c;
+    FILE *fp;
+    int x;
+
+    while ((x = getopt(argc, argv, "n:f:")) != -1) {
+        switch (x) {
+        case 'n': n = strtoul(optarg, NULL, 10); break;
+        case 'f': path = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (!n) usage(argv[0]);
+    res = malloc(n * sizeof(*res));
+    nr = n * (LOGZ_REC_MAX + 4) / LOGZ_BLOCK + 2;
+    blocks = malloc(nr * sizeof(*blocks));
+    lens = malloc(nr * sizeof(*lens));
+    if (!res || !blocks || !lens || !(fp = fopen(path, "w+"))) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%-15s %12s %10s %10s %8s %10s %10s %10s\n", "case", "text MB",
+           "ns/result", "comp MB", "ratio", "encode ns", "comp ns",
+           "decode ns");
+    for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        generate(n, cases[c].all, cases[c].rtt, cases[c].banner);
+
+        if (ftruncate(fileno(fp), 0)) perror(path);
+        rewind(fp);
+        t = cpu_sec();
+        text_bytes = text(fp, cases[c].all, cases[c].rtt);
+        text_cpu = cpu_sec() - t;
+
+        if (ftruncate(fileno(fp), 0)) perror(path);
+        rewind(fp);
+        t = cpu_sec();
+        nr = encode(blocks, lens, cases[c].all, cases[c].rtt);
+        enc_cpu = cpu_sec() - t;
+        t = cpu_sec();
+        z_bytes = compress(fp, blocks, lens, nr);
+        z_cpu = cpu_sec() - t;
+
+        t = cpu_sec();
+        if (check(fp) != res_nr) {
+            fprintf(stderr, "%s: read back does not match\n", cases[c].name);
+            exit(EXIT_FAILURE);
+        }
+        dec_cpu = cpu_sec() - t;
+
+        printf("%-15s %12.1f %10.1f %10.1f %7.1fx %10.1f %10.1f %10.1f\n",
+               cases[c].name, text_bytes / 1048576.0, text_cpu * 1e9 / res_nr,
+               z_bytes / 1048576.0, (double)text_bytes / z_bytes,
+               enc_cpu * 1e9 / res_nr, z_cpu * 1e9 / res_nr,
+               dec_cpu * 1e9 / res_nr);
+    }
+    fclose(fp);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,336 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2008 Alexandru Dreptu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Application probe test: every case plays a scripted service to one
+ * --probe over an in-memory transport and checks the info logged for the
+ * port and what the probe sent. Replies may be cut short anywhere, the
+ * probes must then log only what they were sent. Exits non-zero if any
+ * case fails.
+ *
+ * Compiling: gcc -O2 -Wall -std=gnu11 -I.. probetest.c ../libcscan.c \
+ *            -o probetest
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cscan.h"
+
+#define IP 0x7f000001 // 127.0.0.1
+#define REPLIES 4
+
+struct test {
+    int probe;
+    unsigned int port;
+    // reply[i] is sent after the probe's i-th request; after the last one
+    // the service hangs up, "" waits for the next request
+    const char *reply[REPLIES];
+    const char *info; // logged for the port
+    const char *sent; // in the requests, NULL = only the first one is sent
+};
+
+const struct test tests[] = {
+    {CSCAN_PROBE_BANNER, 22, {"SSH-2.0-test\r\n"}, "SSH-2.0-test", NULL},
+    {CSCAN_PROBE_HTTP,
+     80,
+     {"", "HTTP/1.1 301 Moved\r\nLocation: /a\r\nContent-Length: 3\r\n\r\nabc",
+      "HTTP/1.1 200 OK\r\n"},
+     "HTTP/1.1 301 Moved -> /a 200 OK",
+     "GET /a HTTP/1.1\r\nHost: 127.0.0.1\r\n"},
+    {CSCAN_PROBE_HTTP,
+     80,
+     {"", "HTTP/1.1 302 Found\r\nLocation: http://127.0.0.1/b?c\r\n"
+          "Content-Length: 0\r\n\r\n",
+      "HTTP/1.1 404 Not Found\r\n"},
+     "HTTP/1.1 302 Found -> http://127.0.0.1/b?c 404 Not Found",
+     "GET /b?c HTTP/1.1\r\n"},
+    {CSCAN_PROBE_HTTP,
+     8080,
+     {"", "HTTP/1.1 302 Found\r\nLocation: http://127.0.0.1:8080\r\n"
+          "Content-Length: 0\r\n\r\n",
+      "HTTP/1.1 200 OK\r\n"},
+     "HTTP/1.1 302 Found -> http://127.0.0.1:8080 200 OK",
+     "GET / HTTP/1.1\r\n"},
+    // elsewhere: another host, another port or scheme, not followed
+    {CSCAN_PROBE_HTTP,
+     80,
+     {"", "HTTP/1.1 301 Moved\r\nLocation: http://example.com/x\r\n"
+          "Content-Length: 0\r\n\r\n",
+      "HTTP/1.1 200 OK\r\n"},
+     "HTTP/1.1 301 Moved -> http://example.com/x",
+     NULL},
+    {CSCAN_PROBE_HTTP,
+     80,
+     {"", "HTTP/1.1 301 Moved\r\nLocation: //example.com/x\r\n"
+          "Content-Length: 0\r\n\r\n",
+      "HTTP/1.1 200 OK\r\n"},
+     "HTTP/1.1 301 Moved -> //example.com/x",
+     NULL},
+    {CSCAN_PROBE_HTTP,
+     80,
+     {"", "HTTP/1.1 301 Moved\r\nLocation: http://127.0.0.1:8080/x\r\n"
+          "Content-Length: 0\r\n\r\n",
+      "HTTP/1.1 200 OK\r\n"},
+     "HTTP/1.1 301 Moved -> http://127.0.0.1:8080/x",
+     NULL},
+    {CSCAN_PROBE_HTTP,
+     80,
+     {"", "HTTP/1.1 301 Moved\r\nLocation: http://127.0.0.10/x\r\n"
+          "Content-Length: 0\r\n\r\n",
+      "HTTP/1.1 200 OK\r\n"},
+     "HTTP/1.1 301 Moved -> http://127.0.0.10/x",
+     NULL},
+    {CSCAN_PROBE_HTTP,
+     443,
+     {"", "HTTP/1.1 301 Moved\r\nLocation: https://127.0.0.1:443/x\r\n"
+          "Content-Length: 0\r\n\r\n",
+      "HTTP/1.1 200 OK\r\n"},
+     "HTTP/1.1 301 Moved -> https://127.0.0.1:443/x",
+     NULL},
+    // a path too long to keep is not followed rather than cut
+    {CSCAN_PROBE_HTTP,
+     80,
+     {"", "HTTP/1.1 301 Moved\r\nLocation: /"
+          "0123456789012345678901234567890123456789012345678901234567890123"
+          "4567890123456789012345678901234567890123456789012345678901234567"
+          "\r\nContent-Length: 0\r\n\r\n",
+      "HTTP/1.1 200 OK\r\n"},
+     "HTTP/1.1 301 Moved -> /0123456789012345678901234567890123456789012345"
+     "6",
+     NULL},
+    {CSCAN_PROBE_SMTP,
+     25,
+     {"220-mx\r\n220 mx ready\r\n", "250-mx\r\n250-STARTTLS\r\n250 OK\r\n",
+      "220 go ahead\r\n"},
+     "220 mx ready | STARTTLS 220 go ahead",
+     "EHLO cscan\r\nSTARTTLS\r\n"},
+    {CSCAN_PROBE_SMTP,
+     25,
+     {"220 mx\r\n", "250-mx\r\n250 OK\r\n"},
+     "220 mx | no STARTTLS",
+     "EHLO cscan\r\n"},
+    // cut short: lines too short for what is looked at in them
+    {CSCAN_PROBE_BANNER, 22, {"\r\n"}, "", NULL},
+    {CSCAN_PROBE_SMTP, 25, {"220\r\n"}, "220", "EHLO cscan\r\n"},
+    {CSCAN_PROBE_SMTP,
+     25,
+     {"220-mx\r\n22\r\n220 mx ready\r\n", "250 OK\r\n"},
+     "22",
+     NULL},
+    {CSCAN_PROBE_SMTP,
+     25,
+     {"220 mx\r\n", "250-STARTTLS\r\n25\r\n", "220 go ahead\r\n"},
+     "220 mx | STARTTLS 220 go ahead",
+     "EHLO cscan\r\nSTARTTLS\r\n"},
+    {CSCAN_PROBE_SMTP,
+     25,
+     {"220 mx\r\n", "250-mx\r\n250\r\n", "220 go ahead\r\n"},
+     "220 mx | no STARTTLS",
+     "EHLO cscan\r\n"},
+    {CSCAN_PROBE_HTTP, 80, {"", "HTTP/1.1\r\n"}, "HTTP/1.1", NULL},
+    {CSCAN_PROBE_HTTP, 80, {"", ""}, "", NULL},
+    {CSCAN_PROBE_HTTP,
+     80,
+     {"", "HTTP/1.1 3\r\nLocation: /a\r\nContent-Length: 0\r\n\r\n",
+      "HTTP/1.1 200 OK\r\n"},
+     "HTTP/1.1 3",
+     NULL},
+    {CSCAN_PROBE_HTTP,
+     80,
+     {"", "HTTP/1.1 301 Moved\r\nLocation: /a\r\nContent-Length: 0\r\n\r\n",
+      "HTTP/1.1\r\n"},
+     "HTTP/1.1 301 Moved -> /a",
+     "GET /a HTTP/1.1\r\n"},
+    {CSCAN_PROBE_HTTP,
+     80,
+     {"", "HTTP/1.1 301 Moved\r\nLocation: /a\r\nContent-Length: 0\r\n\r\n",
+      "\r\n"},
+     "HTTP/1.1 301 Moved -> /a",
+     "GET /a HTTP/1.1\r\n"},
+    {CSCAN_PROBE_HTTP,
+     80,
+     {"", "HTTP/1.1 301 Moved\r\nLocation: /a\r\nContent-Length: 0\r\n\r\n",
+      "HTTP/1."},
+     "HTTP/1.1 301 Moved -> /a",
+     "GET /a HTTP/1.1\r\n"},
+};
+
+// the service of the slot's current test
+struct service {
+    const struct test *t;
+    unsigned int sent, off; // requests seen, bytes of the reply read
+    int connecting, watched;
+    char log[512];
+} svc[CSCAN_MAX_SOCKS];
+
+const struct test *cur;
+unsigned long clock_ms;
+char info[256];
+
+static int nreplies(const struct test *t) {
+    int n = 0;
+
+    while ((n < REPLIES) && t->reply[n]) n++;
+    return n;
+}
+
+// more of the current reply, or the hang up after the last one
+static int readable(struct service *v) {
+    int n = nreplies(v->t);
+
+    if (v->sent >= n) return 1;
+    return (v->off < strlen(v->t->reply[v->sent])) || (v->sent + 1 == n);
+}
+
+static int t_connect(void *ctx, unsigned int slot, uint32_t ip,
+                     unsigned int port, uint32_t src) {
+    memset(&svc[slot], 0, sizeof(svc[slot]));
+    svc[slot].t = cur;
+    svc[slot].connecting = 1;
+    return 0;
+}
+
+static int t_poll(void *ctx, struct cscan_completion *done, int max) {
+    unsigned int i;
+    int n = 0;
+
+    for (i = 0; (i < CSCAN_MAX_SOCKS) && (n < max); i++) {
+        if (!svc[i].t) continue;
+        if (svc[i].connecting || (svc[i].watched && readable(&svc[i]))) {
+            svc[i].connecting = 0;
+            done[n].slot = i;
+            done[n++].err = 0;
+        }
+    }
+    return n;
+}
+
+static void t_close(void *ctx, unsigned int slot, int rst) {
+    svc[slot].t = NULL;
+}
+
+static unsigned long t_now(void *ctx) { return clock_ms; }
+
+static int t_fd(void *ctx) { return -1; }
+
+static void t_free(void *ctx) {}
+
+static int t_watch(void *ctx, unsigned int slot, int read) {
+    svc[slot].watched = read;
+    return 0;
+}
+
+static ssize_t t_send(void *ctx, unsigned int slot, const void *buf,
+                      size_t len) {
+    struct service *v = &svc[slot];
+    size_t n = strlen(v->log);
+
+    snprintf(v->log + n, sizeof(v->log) - n, "%.*s", (int)len,
+             (const char *)buf);
+    v->sent++;
+    v->off = 0;
+    return len;
+}
+
+static ssize_t t_recv(void *ctx, unsigned int slot, void *buf, size_t len) {
+    struct service *v = &svc[slot];
+    const char *r;
+    size_t n;
+
+    if (v->sent >= nreplies(v->t)) return 0;
+    r = v->t->reply[v->sent];
+    n = strlen(r) - v->off;
+    if (!n) {
+        if (v->sent + 1 == nreplies(v->t)) return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+    // a byte at a time, every line is put together from pieces
+    if (n > 1) n = 1;
+    memcpy(buf, r + v->off, n);
+    v->off += n;
+    return n;
+}
+
+static const struct cscan_transport ops = {t_connect, t_poll,  t_close,
+                                           t_now,     t_fd,    t_free,
+                                           t_watch,   t_send,  t_recv};
+
+void on_result(const struct cscan_result *res, void *arg) {
+    snprintf(info, sizeof(info), "%s", res->info ? res->info : "");
+}
+
+// run t, 0 if it logged and sent what it should
+int run(const struct test *t) {
+    struct cscan_config cfg;
+    struct cscan_stats st;
+    const char *sent;
+    cscan_t *s;
+    int ret;
+
+    cscan_config_init(&cfg);
+    cfg.sockets = 1;
+    cfg.timeout = 5;
+    cfg.probe = t->probe;
+    cur = t;
+    *info = 0;
+    if (!(s = cscan_new(&cfg)) || (cscan_set_transport(s, &ops, NULL) == -1) ||
+        (cscan_add_target(s, IP, IP, t->port, t->port) == -1)) {
+        perror("Cannot create scanner");
+        exit(EXIT_FAILURE);
+    }
+    cscan_set_callback(s, on_result, NULL);
+    // 10 ms a step, a probe left waiting times out
+    do {
+        ret = cscan_step(s);
+        cscan_get_stats(s, &st);
+        clock_ms += 10;
+    } while (ret || st.inflight);
+    cscan_finish(s);
+    cscan_free(s);
+
+    // the first request is the probe's own, the rest follow the replies
+    sent = strstr(svc[0].log, "\r\n\r\n");
+    sent = sent ? sent + 4 : "";
+    if (t->probe == CSCAN_PROBE_SMTP) sent = svc[0].log;
+    ret = strcmp(info, t->info) ||
+          (t->sent ? !strstr(sent, t->sent) : (*sent != 0));
+    if (ret)
+        printf("FAIL port %u: logged \"%s\", want \"%s\"; sent \"%s\"\n",
+               t->port, info, t->info, sent);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int i, failed = 0;
+
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+        failed += run(&tests[i]) != 0;
+    printf("Probe tests %u, failed %u\n", i, failed);
+    return failed ? EXIT_FAILURE : 0;
+}
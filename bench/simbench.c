@@ -0,0 +1,244 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2008 Alexandru Dreptu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Scheduler benchmark: runs the engine on the simulated transport, so only
+ * slot refill, timeout handling and output are measured, no kernel. Every
+ * result is checked against the simulator's model. With -d, hosts found
+ * dead are skipped; a host may only be dropped if its first n results
+ * were timeouts, so no open port may be lost on a host that answered
+ * before that. With -n only the probe count of the target is checked,
+ * which covers ranges too large to run, e.g. -h 0.0.0.0/0 -k 3/7 -n.
+ *
+ * Compiling: gcc -O2 -Wall -std=gnu11 -I.. simbench.c ../libcscan.c \
+ *            ../libcscan-sim.c -o simbench
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cscan.h"
+
+cscan_sim_t *sim;
+FILE *out;
+unsigned long results = 0, wrong = 0;
+uint32_t first_ip;
+unsigned int dead_after;
+
+// per host with -d: timeouts before the first answer, and open ports found
+struct host {
+    unsigned int timeouts, answered, open;
+} *host_log;
+
+void on_result(const struct cscan_result *res, void *arg) {
+    int want = cscan_sim_fate(sim, res->ip, res->port);
+
+    struct host *h;
+
+    results++;
+    if (res->outcome != want) wrong++;
+    if (host_log) {
+        h = &host_log[res->ip - first_ip];
+        if (res->outcome == CSCAN_FILTERED) {
+            if (!h->answered) h->timeouts++;
+        } else if (h->timeouts < dead_after)
+            h->answered = 1;
+        if (res->outcome == CSCAN_OPEN) h->open++;
+    }
+    if (out)
+        fprintf(out, "%u.%u.%u.%u:%u %s\n", res->ip >> 24, (res->ip >> 16) & 0xff,
+                (res->ip >> 8) & 0xff, res->ip & 0xff, res->port,
+                cscan_outcome_name(res->outcome));
+}
+
+double now_sec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void usage(char *this) {
+    printf("\n"
+           "  Usage: %s [options]\n"
+           "\n"
+           "  Options:\n"
+           "    -h <n>   Target ip/n [default 10.0.0.0/16]\n"
+           "    -p <n>   Ports [default 1-16]\n"
+           "    -s <n>   Sockets [default 1024]\n"
+           "    -t <n>   Timeout in virtual seconds [default 1]\n"
+           "    -r <n>   Retries [default 0]\n"
+           "    -d <n>   Drop host after n consecutive timeouts [default off]\n"
+           "    -x       Randomize the ip x port order\n"
+           "    -S <n>   Seed [default 0]\n"
+           "    -O <n>   Open ports per 10000 [default 500]\n"
+           "    -c <n>   Closed ports per 10000 [default 4500]\n"
+           "    -R <n>   RTT in ms, min-max per host [default 20-200]\n"
+           "    -T <n>   Longest virtual clock step in ms [default 10]\n"
+           "    -o <n>   Write results to file\n"
+           "    -H       Put the scanner on huge pages\n"
+           "    -k <i/N> Scan shard i of N\n"
+           "    -n       Only check the probe count, scan nothing\n"
+           "\n",
+           this);
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    struct cscan_config cfg;
+    struct cscan_sim_config sim_cfg;
+    struct cscan_stats st;
+    char hosts[64] = "10.0.0.0/16", ports[32] = "1-16", *dash;
+    unsigned int first_port, last_port;
+    uint32_t last_ip, ip;
+    unsigned long tick = 10, steps = 0, allocs, want, found = 0, lost = 0;
+    unsigned int port, w;
+    double t0, secs;
+    uint64_t nr;
+    cscan_t *s;
+    int x, count_only = 0;
+
+    cscan_config_init(&cfg);
+    cfg.sockets = 1024;
+    cfg.timeout = 1;
+    cscan_sim_config_init(&sim_cfg);
+
+    while ((x = getopt(argc, argv, "h:p:s:t:r:d:xS:O:c:R:T:o:Hk:n")) != -1) {
+        switch (x) {
+        case 'h': snprintf(hosts, sizeof(hosts), "%s", optarg); break;
+        case 'p': snprintf(ports, sizeof(ports), "%s", optarg); break;
+        case 's': cfg.sockets = atoi(optarg); break;
+        case 't': cfg.timeout = atoi(optarg); break;
+        case 'r': cfg.retries = atoi(optarg); break;
+        case 'd': cfg.dead_after = atoi(optarg); break;
+        case 'x': cfg.randomize = 1; break;
+        case 'S': sim_cfg.seed = strtoull(optarg, NULL, 0); break;
+        case 'O': sim_cfg.open = atoi(optarg); break;
+        case 'c': sim_cfg.closed = atoi(optarg); break;
+        case 'R':
+            sim_cfg.rtt_min = sim_cfg.rtt_max = atoi(optarg);
+            if ((dash = strchr(optarg, '-'))) sim_cfg.rtt_max = atoi(dash + 1);
+            break;
+        case 'T': tick = atol(optarg); break;
+        case 'H': cfg.huge_pages = 1; break;
+        case 'k':
+            if ((sscanf(optarg, "%" SCNu64 "/%" SCNu64, &cfg.shard_idx,
+                        &cfg.shard_nr) != 2) ||
+                !cfg.shard_idx || (cfg.shard_idx > cfg.shard_nr))
+                usage(argv[0]);
+            cfg.shard_idx--;
+            break;
+        case 'n': count_only = 1; break;
+        case 'o':
+            if (!(out = fopen(optarg, "w"))) {
+                perror("Cannot open/create output file");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default: usage(argv[0]);
+        }
+    }
+
+    if ((cscan_parse_hosts(hosts, &first_ip, &last_ip) == -1) ||
+        (cscan_parse_ports(ports, &first_port, &last_port) == -1) || !tick) {
+        printf("Invalid arguments, try `%s -?' for usage.\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if ((dead_after = cfg.dead_after) &&
+        !(host_log = calloc(last_ip - first_ip + 1UL, sizeof(*host_log)))) {
+        perror("Cannot allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    if (!(s = cscan_new(&cfg)) || !(sim = cscan_sim_new(&sim_cfg))) {
+        perror("Cannot create scanner");
+        exit(EXIT_FAILURE);
+    }
+    if ((cscan_set_transport(s, cscan_sim_transport(), sim) == -1) ||
+        (cscan_add_target(s, first_ip, last_ip, first_port, last_port) == -1)) {
+        fprintf(stderr, "%s\n", cscan_error(s));
+        exit(EXIT_FAILURE);
+    }
+    cscan_set_callback(s, on_result, NULL);
+    cscan_get_stats(s, &st);
+    allocs = st.allocs;
+    // every shard_nr-th probe from shard_idx on, counted in 64 bits
+    nr = ((uint64_t)last_ip - first_ip + 1) * (last_port - first_port + 1);
+    nr = (nr > cfg.shard_idx)
+             ? (nr - cfg.shard_idx + cfg.shard_nr - 1) / cfg.shard_nr
+             : 0;
+    if (st.total != nr) {
+        printf("Probes %" PRIu64 " queued, %" PRIu64 " expected\n", st.total,
+               nr);
+        exit(EXIT_FAILURE);
+    }
+    if (count_only) {
+        printf("Probes %" PRIu64 " queued\n", st.total);
+        cscan_free(s);
+        return 0;
+    }
+
+    t0 = now_sec();
+    while (cscan_step(s) || cscan_sim_busy(sim)) {
+        cscan_sim_advance(sim, tick);
+        steps++;
+    }
+    cscan_finish(s);
+    secs = now_sec() - t0;
+    cscan_get_stats(s, &st);
+
+    printf("Probes %lu in %.2fs, %.0f probes/sec, %lu steps\n",
+           (unsigned long)st.total, secs, secs ? st.total / secs : 0, steps);
+    printf("Open %lu, closed %lu, filtered %lu, retries %lu\n",
+           st.outcomes[CSCAN_OPEN], st.outcomes[CSCAN_CLOSED],
+           st.outcomes[CSCAN_FILTERED], st.retries_sent);
+    printf("Results %lu, wrong %lu\n", results, wrong);
+    if (host_log) {
+        for (want = 0, ip = first_ip;; ip++) {
+            for (port = first_port, w = 0; port <= last_port; port++)
+                w += cscan_sim_fate(sim, ip, port) == CSCAN_OPEN;
+            want += w;
+            found += host_log[ip - first_ip].open;
+            if (host_log[ip - first_ip].answered)
+                lost += w - host_log[ip - first_ip].open;
+            if (ip == last_ip) break;
+        }
+        printf("Dead hosts %lu, probes saved %lu, open found %lu of %lu, "
+               "lost on hosts that answered %lu\n",
+               st.dead_hosts, st.probes_saved, found, want, lost);
+    }
+    printf("Heap allocations %lu during the scan, arena %lu KB on %s pages\n",
+           st.allocs - allocs, st.arena_size >> 10,
+           (st.huge_pages == CSCAN_HUGE_TLB)   ? "huge"
+           : (st.huge_pages == CSCAN_HUGE_THP) ? "transparent huge"
+                                               : "normal");
+    if (out) fclose(out);
+    cscan_free(s);
+    return (wrong || lost || (results + st.probes_saved != st.total))
+               ? EXIT_FAILURE
+               : 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2008 Alexandru Dreptu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Per-tick cost of the engine against the slot count: one tick is a
+ * cscan_step() plus a cscan_next_timeout(), as in cscan's main loop, with
+ * nothing completing. "full" has every slot in flight, "sparse" only one
+ * (held back by the rate limiter) out of the same slot count.
+ *
+ * Compiling: gcc -O2 -Wall -std=gnu11 -I.. tickbench.c ../libcscan.c \
+ *            ../libcscan-sim.c -o tickbench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cscan.h"
+
+double now_sec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ns per tick with sockets slots, of which only one in flight if sparse
+double measure(unsigned int sockets, int sparse, unsigned long ticks) {
+    struct cscan_config cfg;
+    struct cscan_sim_config sim_cfg;
+    struct cscan_stats st;
+    cscan_sim_t *sim;
+    cscan_t *s;
+    unsigned long i;
+    double start;
+    long sink = 0;
+
+    cscan_config_init(&cfg);
+    cfg.sockets = sockets;
+    cfg.timeout = 3600;
+    if (sparse) cfg.rate = 1;
+    cscan_sim_config_init(&sim_cfg);
+    sim_cfg.open = sim_cfg.closed = 0; // nothing ever answers
+    if (!(s = cscan_new(&cfg)) || !(sim = cscan_sim_new(&sim_cfg))) {
+        perror("Cannot create scanner");
+        exit(EXIT_FAILURE);
+    }
+    cscan_set_transport(s, cscan_sim_transport(), sim);
+    cscan_add_target(s, 0x0a000000, 0x0a00ffff, 1, 1024);
+
+    // fill the slots, the clock stands still from here on
+    do {
+        cscan_step(s);
+        cscan_get_stats(s, &st);
+    } while (st.inflight < (sparse ? 1 : sockets));
+
+    start = now_sec();
+    for (i = 0; i < ticks; i++) {
+        cscan_step(s);
+        sink += cscan_next_timeout(s);
+    }
+    start = now_sec() - start;
+    if (sink == -1) puts(""); // keep the calls
+    cscan_free(s);
+    return start * 1e9 / ticks;
+}
+
+void usage(char *this) {
+    printf("\n"
+           "  Usage: %s [options]\n"
+           "\n"
+           "  Options:\n"
+           "    -s <n>   Slot counts, comma separated [default 16,64,256,1024]\n"
+           "    -n <n>   Ticks per measurement [default 200000]\n"
+           "\n",
+           this);
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    char slots[256] = "16,64,256,1024", *tok;
+    unsigned long ticks = 200000;
+    unsigned int n;
+    int x;
+
+    while ((x = getopt(argc, argv, "s:n:")) != -1) {
+        switch (x) {
+        case 's': snprintf(slots, sizeof(slots), "%s", optarg); break;
+        case 'n': ticks = strtoul(optarg, NULL, 10); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (!ticks) usage(argv[0]);
+
+    printf("%8s %14s %14s\n", "slots", "full ns/tick", "sparse ns/tick");
+    for (tok = strtok(slots, ","); tok; tok = strtok(NULL, ",")) {
+        n = atoi(tok);
+        if ((n < 1) || (n > CSCAN_MAX_SOCKS)) {
+            fprintf(stderr, "Slot count must be within 1-%u.\n",
+                    CSCAN_MAX_SOCKS);
+            exit(EXIT_FAILURE);
+        }
+        printf("%8u %14.1f %14.1f\n", n, measure(n, 0, ticks),
+               measure(n, 1, ticks));
+    }
+    return 0;
+}
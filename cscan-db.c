@@ -0,0 +1,199 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2008 Alexandru Dreptu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Query the result database of cscan --db: count or list the addresses
+ * with a port open over a range, straight from the mapped bitmaps.
+ * Compiling: gcc -O3 -march=native -Wall -std=gnu11 cscan-db.c -o cscan-db
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cscan-db.h"
+
+unsigned char *map;
+uint32_t units;
+unsigned long scanned = 0; // bitmap bytes looked at
+
+// set bits lo..hi of a /16 bitmap
+unsigned long count_bits(const uint64_t *w, unsigned int lo, unsigned int hi) {
+    unsigned int a = lo >> 6, b = hi >> 6, i;
+    uint64_t first = ~0ULL << (lo & 63), last = ~0ULL >> (63 - (hi & 63));
+    unsigned long n;
+
+    scanned += (b - a + 1) * sizeof(*w);
+    if (a == b) return __builtin_popcountll(w[a] & first & last);
+    n = __builtin_popcountll(w[a] & first) + __builtin_popcountll(w[b] & last);
+    // plain words, POPCNT (and vectorized where the CPU can) with -march
+    for (i = a + 1; i < b; i++) n += __builtin_popcountll(w[i]);
+    return n;
+}
+
+// print the addresses of bits lo..hi of the bitmap of /16 net
+unsigned long list_bits(const uint64_t *w, uint32_t net, unsigned int lo,
+                        unsigned int hi, unsigned int port) {
+    unsigned int a = lo >> 6, b = hi >> 6, i;
+    unsigned long n = 0;
+    uint32_t ip;
+    uint64_t x;
+
+    scanned += (b - a + 1) * sizeof(*w);
+    for (i = a; i <= b; i++) {
+        if (!(x = w[i])) continue;
+        if (i == a) x &= ~0ULL << (lo & 63);
+        if (i == b) x &= ~0ULL >> (63 - (hi & 63));
+        for (; x; x &= x - 1) {
+            ip = (net << 16) | (i << 6) | __builtin_ctzll(x);
+            printf("%u.%u.%u.%u:%u\n", ip >> 24, (ip >> 16) & 0xff,
+                   (ip >> 8) & 0xff, ip & 0xff, port);
+            n++;
+        }
+    }
+    return n;
+}
+
+void usage(char *this) {
+    printf("\n"
+           "  Query a cscan result database\n"
+           "\n"
+           "  Usage: %s [options] <file>\n"
+           "\n"
+           "  Options:\n"
+           "    -p <n>   Port/s [e.g. 443 or 1-1024, default all]\n"
+           "    -h <n>   Host/s [e.g. 10.1.0.0/16, default all]\n"
+           "    -l       List open ip:port instead of counting per port\n"
+           "\n"
+           "  Exits with 0 if any port is open in the range, else 1.\n"
+           "\n",
+           this);
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long first_port = 1, last_port = 65535, port, n, total = 0;
+    uint32_t first_ip = 0, last_ip = 0xffffffff, net;
+    unsigned long bits = 32, ports_nr = 0;
+    char *slash, *dash;
+    struct in_addr addr;
+    struct db_header *h;
+    struct timespec t0, t1;
+    struct stat sb;
+    uint64_t *bitmap;
+    int x, fd, list = 0;
+    double ms;
+
+    while ((x = getopt(argc, argv, "p:h:l")) != -1) {
+        switch (x) {
+        case 'p':
+            first_port = last_port = strtoul(optarg, &dash, 10);
+            if (*dash == '-') last_port = strtoul(dash + 1, NULL, 10);
+            if (!first_port || (first_port > last_port) || (last_port > 65535)) {
+                fprintf(stderr, "Port must be a number within 1-65535\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'h':
+            if ((slash = strchr(optarg, '/'))) {
+                *slash++ = 0;
+                bits = strtoul(slash, NULL, 10);
+            }
+            if (!inet_aton(optarg, &addr) || (bits > 32)) {
+                fprintf(stderr, "Invalid IP address given.\n");
+                exit(EXIT_FAILURE);
+            }
+            first_ip = ntohl(addr.s_addr) & (bits ? ~0U << (32 - bits) : 0);
+            last_ip = first_ip | (bits ? ~(~0U << (32 - bits)) : ~0U);
+            break;
+        case 'l': list = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) usage(argv[0]);
+
+    if ((fd = open(argv[optind], O_RDONLY)) == -1) {
+        perror(argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    if (fstat(fd, &sb) == -1) {
+        perror("Cannot stat database");
+        exit(EXIT_FAILURE);
+    }
+    if (sb.st_size < (off_t)(DB_HEADER_UNITS * DB_UNIT)) goto bad;
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Cannot map database");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    h = (struct db_header *)map;
+    if (memcmp(h->magic, DB_MAGIC, sizeof(h->magic))) goto bad;
+    // a scan may be adding to it, only what was there when mapped counts
+    units = h->units;
+    if (units > sb.st_size / DB_UNIT) units = sb.st_size / DB_UNIT;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (port = first_port; port <= last_port; port++) {
+        if (!h->ports[port]) continue;
+        n = 0;
+        for (net = first_ip >> 16;; net++) {
+            if ((bitmap = db_bitmap(map, units, port, net << 16))) {
+                x = (net == first_ip >> 16) ? first_ip & 0xffff : 0;
+                if (list)
+                    n += list_bits(bitmap, net, x,
+                                   (net == last_ip >> 16) ? last_ip & 0xffff
+                                                          : 0xffff,
+                                   port);
+                else
+                    n += count_bits(bitmap, x,
+                                    (net == last_ip >> 16) ? last_ip & 0xffff
+                                                           : 0xffff);
+            }
+            if (net == last_ip >> 16) break;
+        }
+        if (n && !list) printf("%lu %lu\n", port, n);
+        if (n) ports_nr++;
+        total += n;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    fprintf(stderr, "%lu open on %lu ports, %.1f MB of bitmaps in %.2f ms (%.1f GB/s)\n",
+            total, ports_nr, scanned / 1048576.0, ms,
+            ms ? scanned / ms / 1e6 : 0);
+    return total ? 0 : 1;
+
+bad:
+    fprintf(stderr, "%s is not a cscan database.\n", argv[optind]);
+    exit(EXIT_FAILURE);
+}
@@ -0,0 +1,71 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2008 Alexandru Dreptu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * On-disk layout of the result database written by cscan --db and read by
+ * cscan-db.
+ *
+ * The file is made of 8 KB units. The header holds, for every port, the
+ * unit of that port's /16 table; the table holds, for every /16, the unit
+ * of its bitmap, and the bitmap has one bit per address of the /16, set
+ * while the port is open there. 0 means none, so a port or /16 without an
+ * open address takes no space. Numbers are in host order, the file is
+ * only good for the machine type that wrote it.
+ */
+
+#ifndef CSCAN_DB_H
+#define CSCAN_DB_H
+
+#include <stdint.h>
+
+#define DB_MAGIC "cscandb1"
+#define DB_UNIT 8192 // bytes, also the size of one /16 bitmap
+#define DB_PORTS 65536
+#define DB_TABLE_UNITS (65536 * sizeof(uint32_t) / DB_UNIT)
+#define DB_HEADER_UNITS                                                        \
+    ((sizeof(struct db_header) + DB_UNIT - 1) / DB_UNIT)
+#define DB_MAP_MAX (1ULL << 40) // address space kept for the file to grow in
+
+struct db_header {
+    char magic[8];
+    uint32_t units; // in use, the file may be longer
+    uint32_t unused;
+    uint32_t ports[DB_PORTS];
+};
+
+// the bitmap of ip's /16 for port in a map of units units, NULL if none
+static inline uint64_t *db_bitmap(unsigned char *map, uint32_t units,
+                                  unsigned int port, uint32_t ip) {
+    struct db_header *h = (struct db_header *)map;
+    uint32_t *table, unit;
+
+    if (!h->ports[port] || (h->ports[port] + DB_TABLE_UNITS > units))
+        return NULL;
+    table = (uint32_t *)(map + (uint64_t)h->ports[port] * DB_UNIT);
+    unit = table[ip >> 16];
+    if (!unit || (unit >= units)) return NULL;
+    return (uint64_t *)(map + (uint64_t)unit * DB_UNIT);
+}
+
+#endif
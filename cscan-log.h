@@ -0,0 +1,232 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2008 Alexandru Dreptu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Format of the compressed result log written by cscan --compress and read
+ * by cscan-merge.
+ *
+ * The file starts with LOGZ_MAGIC and is a row of blocks, each a struct
+ * logz_block and len bytes of data; len == raw_len means stored as is,
+ * else the data is LZ77 compressed (sequences as in LZ4: a token with the
+ * literal and match lengths, the literals, a 16 bit offset). LOGZ_MAGIC may
+ * come again between blocks where a run appended to the file.
+ *
+ * Uncompressed, a block is a row of records, each one line of the text
+ * log: a flags byte (the outcome and which parts the line has), the
+ * address as a zigzag varint delta to the one before in the block, the
+ * port, the RTT in us and the length and bytes of the info, all varints.
+ * Numbers in the headers are in host order.
+ */
+
+#ifndef CSCAN_LOG_H
+#define CSCAN_LOG_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define LOGZ_MAGIC "cscanlz1"
+#define LOGZ_BLOCK 65536 // raw bytes, at most
+#define LOGZ_BOUND(n) ((n) + (n) / 255 + 16) // compressed, at most
+#define LOGZ_INFO_MAX 160 // as in the text log
+#define LOGZ_REC_MAX (1 + 5 + 3 + 10 + 2 + LOGZ_INFO_MAX)
+#define LOGZ_HASH_BITS 12
+
+// flags byte of a record, the low 3 bits are the outcome
+#define LOGZ_STATE 0x08
+#define LOGZ_RTT 0x10
+#define LOGZ_INFO 0x20
+
+struct logz_block {
+    uint32_t raw_len;
+    uint32_t len;
+};
+
+struct logz_rec {
+    uint32_t ip;
+    unsigned int port, outcome, flags;
+    unsigned long rtt_us;
+    const char *info; // not terminated
+    unsigned int info_len;
+};
+
+static inline unsigned char *logz_put_varint(unsigned char *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static inline const unsigned char *
+logz_get_varint(const unsigned char *p, const unsigned char *end, uint64_t *v) {
+    int shift = 0;
+
+    *v = 0;
+    while (p < end && (shift < 64)) {
+        *v |= (uint64_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) return p;
+        shift += 7;
+    }
+    return NULL;
+}
+
+// append a record at p, at most LOGZ_REC_MAX bytes; *prev is the address
+// of the record before, 0 at the start of a block
+static inline unsigned char *logz_put(unsigned char *p, uint32_t *prev,
+                                      const struct logz_rec *r) {
+    int32_t d = r->ip - *prev;
+
+    *prev = r->ip;
+    *p++ = r->flags | r->outcome;
+    p = logz_put_varint(p, ((uint32_t)d << 1) ^ (uint32_t)(d >> 31));
+    p = logz_put_varint(p, r->port);
+    if (r->flags & LOGZ_RTT) p = logz_put_varint(p, r->rtt_us);
+    if (r->flags & LOGZ_INFO) {
+        p = logz_put_varint(p, r->info_len);
+        memcpy(p, r->info, r->info_len);
+        p += r->info_len;
+    }
+    return p;
+}
+
+// read the record at p, NULL if it is cut short
+static inline const unsigned char *logz_get(const unsigned char *p,
+                                            const unsigned char *end,
+                                            uint32_t *prev, struct logz_rec *r) {
+    uint64_t v;
+
+    if (p >= end) return NULL;
+    r->outcome = *p & 7;
+    r->flags = *p++ & ~7;
+    if (!(p = logz_get_varint(p, end, &v))) return NULL;
+    r->ip = *prev += (uint32_t)(v >> 1) ^ -(uint32_t)(v & 1);
+    if (!(p = logz_get_varint(p, end, &v))) return NULL;
+    r->port = v;
+    r->rtt_us = 0;
+    if ((r->flags & LOGZ_RTT) && !(p = logz_get_varint(p, end, &v))) return NULL;
+    if (r->flags & LOGZ_RTT) r->rtt_us = v;
+    r->info = NULL;
+    r->info_len = 0;
+    if (r->flags & LOGZ_INFO) {
+        if (!(p = logz_get_varint(p, end, &v)) || (v > end - p)) return NULL;
+        r->info = (const char *)p;
+        r->info_len = v;
+        p += v;
+    }
+    return p;
+}
+
+static inline uint32_t logz_read32(const unsigned char *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned char *logz_put_len(unsigned char *p, size_t n) {
+    for (; n >= 255; n -= 255) *p++ = 255;
+    *p++ = n;
+    return p;
+}
+
+// LZ77 of n <= LOGZ_BLOCK bytes into dst (LOGZ_BOUND(n) bytes), returns the
+// compressed length. Greedy, one hash probe per position, and it skips
+// ahead faster the longer nothing matches.
+static inline size_t logz_compress(const unsigned char *src, size_t n,
+                                   unsigned char *dst) {
+    uint16_t table[1 << LOGZ_HASH_BITS] = {0};
+    size_t ip = 0, anchor = 0, ref, lit, len;
+    unsigned char *op = dst, *token;
+    uint32_t seq, h;
+
+    while (ip + 12 <= n) {
+        seq = logz_read32(src + ip);
+        h = (seq * 2654435761U) >> (32 - LOGZ_HASH_BITS);
+        ref = table[h];
+        table[h] = ip;
+        if ((ref >= ip) || (logz_read32(src + ref) != seq)) {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        for (len = 4; (ip + len < n) && (src[ref + len] == src[ip + len]);)
+            len++;
+        lit = ip - anchor;
+        token = op++;
+        *token = ((lit < 15 ? lit : 15) << 4) | (len - 4 < 15 ? len - 4 : 15);
+        if (lit >= 15) op = logz_put_len(op, lit - 15);
+        memcpy(op, src + anchor, lit);
+        op += lit;
+        *op++ = ip - ref;
+        *op++ = (ip - ref) >> 8;
+        if (len - 4 >= 15) op = logz_put_len(op, len - 4 - 15);
+        ip += len;
+        anchor = ip;
+    }
+
+    // the rest as literals, a sequence without a match ends the block
+    lit = n - anchor;
+    *op++ = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15) op = logz_put_len(op, lit - 15);
+    memcpy(op, src + anchor, lit);
+    return op + lit - dst;
+}
+
+// undo logz_compress() into dst of cap bytes, the length or -1 if corrupt
+static inline long logz_decompress(const unsigned char *src, size_t n,
+                                   unsigned char *dst, size_t cap) {
+    const unsigned char *end = src + n;
+    size_t lit, len, off, op = 0;
+    unsigned int x;
+
+    while (src < end) {
+        x = *src++;
+        lit = x >> 4;
+        if (lit == 15)
+            do {
+                if (src == end) return -1;
+                lit += *src;
+            } while (*src++ == 255);
+        if ((lit > end - src) || (lit > cap - op)) return -1;
+        memcpy(dst + op, src, lit);
+        src += lit;
+        op += lit;
+        if (src == end) break;
+        if (end - src < 2) return -1;
+        off = src[0] | (src[1] << 8);
+        src += 2;
+        len = (x & 15) + 4;
+        if ((x & 15) == 15)
+            do {
+                if (src == end) return -1;
+                len += *src;
+            } while (*src++ == 255);
+        if (!off || (off > op) || (len > cap - op)) return -1;
+        // may overlap, byte by byte
+        for (; len; len--, op++) dst[op] = dst[op - off];
+    }
+    return op;
+}
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2008 Alexandru Dreptu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Merge cscan output files (e.g. the results of --shard runs) into one
+ * sorted list without duplicates. Files written with --compress are read
+ * too, so this is also how they are turned back into text.
+ * Compiling: gcc -Wall -std=gnu11 cscan-merge.c -o cscan-merge
+ */
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cscan-log.h"
+
+#define NO_STATE 0xff
+
+// same order as the CSCAN_* outcomes in cscan.h, lower wins on duplicates
+const char *states[] = {"open", "closed", "filtered", "unreachable", "error"};
+#define STATES_NR (sizeof(states) / sizeof(states[0]))
+
+struct record {
+    uint64_t key; // ip << 16 | port
+    unsigned char state;
+    char *info; // what a --probe found, or NULL
+};
+
+struct record *recs;
+unsigned long recs_nr = 0, recs_max = 0;
+unsigned long bad_lines = 0;
+
+int rec_cmp(const void *a, const void *b) {
+    const struct record *ra = a, *rb = b;
+
+    if (ra->key != rb->key) return (ra->key < rb->key) ? -1 : 1;
+    return ra->state - rb->state;
+}
+
+// parse "ip:port[ state][ info]" and store it
+void add_line(char *line) {
+    char *colon, *state;
+    struct in_addr addr;
+    unsigned long port;
+    unsigned int i;
+    size_t len;
+
+    line[strcspn(line, "\r\n")] = 0;
+    if (!*line) return;
+    if (!(colon = strchr(line, ':'))) goto bad;
+    *colon++ = 0;
+    if (!inet_aton(line, &addr)) goto bad;
+    port = strtoul(colon, &state, 10);
+    if (!port || (port > 65535)) goto bad;
+
+    if (recs_nr == recs_max) {
+        recs_max = recs_max ? recs_max * 2 : 65536;
+        recs = realloc(recs, recs_max * sizeof(struct record));
+        if (!recs) {
+            perror("Cannot allocate memory");
+            exit(EXIT_FAILURE);
+        }
+    }
+    recs[recs_nr].key = ((uint64_t)ntohl(addr.s_addr) << 16) | port;
+    recs[recs_nr].state = NO_STATE;
+    recs[recs_nr].info = NULL;
+    while (*state == ' ') state++;
+    for (i = 0; *state && (i < STATES_NR); i++) {
+        len = strlen(states[i]);
+        if (!strncmp(state, states[i], len) &&
+            ((state[len] == ' ') || !state[len])) {
+            recs[recs_nr].state = i;
+            state += len;
+            while (*state == ' ') state++;
+            break;
+        }
+    }
+    if (*state && !(recs[recs_nr].info = strdup(state))) {
+        perror("Cannot allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    recs_nr++;
+    return;
+
+bad:
+    bad_lines++;
+}
+
+// the lines of a --compress file, as cscan would have written them
+void read_logz(FILE *fp, const char *name) {
+    static unsigned char raw[LOGZ_BLOCK], data[LOGZ_BOUND(LOGZ_BLOCK)];
+    char magic[sizeof(LOGZ_MAGIC) - 1], line[512], *l;
+    const unsigned char *p, *end;
+    struct logz_block b;
+    struct logz_rec r;
+    uint32_t prev;
+    long n;
+
+    while (fread(&b, sizeof(b), 1, fp) == 1) {
+        // a run that appended starts over with the magic, as long as a header
+        if (!memcmp(&b, LOGZ_MAGIC, sizeof(magic))) continue;
+        if ((b.raw_len > LOGZ_BLOCK) || (b.len > b.raw_len) ||
+            (fread(data, 1, b.len, fp) != b.len))
+            goto bad;
+        if (b.len == b.raw_len) {
+            memcpy(raw, data, b.len);
+            n = b.len;
+        } else if ((n = logz_decompress(data, b.len, raw, b.raw_len)) !=
+                   b.raw_len)
+            goto bad;
+        for (p = raw, end = raw + n, prev = 0; p < end;) {
+            if (!(p = logz_get(p, end, &prev, &r)) || (r.outcome >= STATES_NR))
+                goto bad;
+            l = line + sprintf(line, "%u.%u.%u.%u:%u", r.ip >> 24,
+                               (r.ip >> 16) & 0xff, (r.ip >> 8) & 0xff,
+                               r.ip & 0xff, r.port);
+            if (r.flags & LOGZ_STATE) l += sprintf(l, " %s", states[r.outcome]);
+            if (r.flags & LOGZ_RTT) l += sprintf(l, " %luus", r.rtt_us);
+            if (r.flags & LOGZ_INFO)
+                sprintf(l, " %.*s", (int)r.info_len, r.info);
+            add_line(line);
+        }
+    }
+    return;
+
+bad:
+    fprintf(stderr, "%s: corrupt compressed block, rest skipped\n", name);
+}
+
+void read_file(FILE *fp, const char *name) {
+    char line[512];
+    int c;
+
+    // text starts with a digit, compressed output with the magic
+    if ((c = getc(fp)) == EOF) return;
+    ungetc(c, fp);
+    if (c == LOGZ_MAGIC[0]) {
+        read_logz(fp, name);
+        return;
+    }
+    while (fgets(line, sizeof(line), fp)) add_line(line);
+}
+
+void usage(char *this) {
+    printf("\n"
+           "  Merge cscan result files\n"
+           "\n"
+           "  Usage: %s [-o <file>] [file ...]\n"
+           "\n"
+           "  Options:\n"
+           "    -o <n>   Output file [default stdout]\n"
+           "\n"
+           "  Reads stdin when no file is given.\n"
+           "\n",
+           this);
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    FILE *fp, *out = stdout;
+    unsigned long i, dups = 0, written = 0;
+    struct in_addr addr;
+    int x;
+
+    while ((x = getopt(argc, argv, "o:h")) != -1) {
+        switch (x) {
+        case 'o':
+            if (!(out = fopen(optarg, "w"))) {
+                perror("Cannot open/create output file");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'h': usage(argv[0]);
+        default: printf("Try `%s -h' for usage.\n", argv[0]); exit(0);
+        }
+    }
+
+    if (optind == argc) read_file(stdin, "stdin");
+    for (x = optind; x < argc; x++) {
+        if (!(fp = fopen(argv[x], "r"))) {
+            perror(argv[x]);
+            exit(EXIT_FAILURE);
+        }
+        read_file(fp, argv[x]);
+        fclose(fp);
+    }
+
+    qsort(recs, recs_nr, sizeof(struct record), rec_cmp);
+    for (i = 0; i < recs_nr; i++) {
+        if (i && (recs[i].key == recs[i - 1].key)) {
+            dups++;
+            continue;
+        }
+        addr.s_addr = htonl(recs[i].key >> 16);
+        fprintf(out, "%s:%u", inet_ntoa(addr),
+                (unsigned int)(recs[i].key & 0xffff));
+        if (recs[i].state != NO_STATE)
+            fprintf(out, " %s", states[recs[i].state]);
+        if (recs[i].info) fprintf(out, " %s", recs[i].info);
+        fputc('\n', out);
+        written++;
+    }
+
+    fprintf(stderr, "%lu records from %d files, %lu duplicates, %lu bad lines\n",
+            written, (optind == argc) ? 1 : argc - optind, dups, bad_lines);
+    if (out != stdout) fclose(out);
+    for (i = 0; i < recs_nr; i++) free(recs[i].info);
+    free(recs);
+    return 0;
+}
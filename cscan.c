@@ -24,108 +24,1723 @@
 
 /*
  * Simple TCP port scanner using non-blocking sockets.
- * Compiling: gcc -Wall -std=gnu11 cscan.c -o cscan
+ * Compiling: gcc -Wall -std=gnu11 -pthread cscan.c libcscan.c \
+ *            libcscan-replay.c -o cscan
  */
 
+#define _GNU_SOURCE // sched_setaffinity()
+
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
-#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
-#define MAX_SOCKS 1024
-#define STATUS_NONE 1
-#define STATUS_CONNECTING 2
+#include "cscan-db.h"
+#include "cscan-log.h"
+#include "cscan.h"
+
+// results are batched before they hit the output file
+#define LOG_BUF_SIZE 65536
+
+// seconds between TIME_WAIT / port usage reports
+#define STATS_INTERVAL 5
+
+// long only options
+#define OPT_SOURCE_IP 256
+#define OPT_TEARDOWN 257
+#define OPT_SHARD 258
+#define OPT_RANDOMIZE 259
+#define OPT_SEED 260
+#define OPT_DAEMON 261
+#define OPT_CONTROL 262
+#define OPT_RATE 263
+#define OPT_PROBE 264
+#define OPT_HUGE_PAGES 265
+#define OPT_KERNEL_TIMEOUT 266
+#define OPT_BUSY_POLL 267
+#define OPT_RTT 268
+#define OPT_PCAP 269
+#define OPT_PCAP_OPEN 270
+#define OPT_PCAP_SIZE 271
+#define OPT_PCAP_FILES 272
+#define OPT_REPLAY 273
+#define OPT_DEDUP 274
+#define OPT_DB 275
+#define OPT_DIFF 276
+#define OPT_COMPRESS 277
+#define OPT_DEDUP_MEM 278
+
+// SO_BUSY_POLL us with --busy-poll
+#define BUSY_POLL_US 50
+
+// packet capture
+#define PCAP_SNAPLEN 256
+#define PCAP_RING_SIZE (8 << 20)
+#define PCAP_BATCH 64
+#define PCAP_HOLD_PKTS 16 // packets held back per socket with --pcap-open
+#define PCAP_HOLD_IDLE 2 // seconds after the timeout a held probe is let go
+#define PCAP_LINKTYPE_RAW 101
+
+// duplicate filter, capacity of the first stage is the probe count up to
+// DEDUP_FIRST, each further stage doubles until DEDUP_MEM MB are in use
+#define DEDUP_MIN 4096
+#define DEDUP_FIRST (1 << 20)
+#define DEDUP_STAGES 32
+#define DEDUP_MEM 256
 
-struct connection {
-    int sock;
-    int status;
-    time_t conn_time;
-    struct sockaddr_in caddr;
+// units the result database grows by
+#define DB_GROW 1024
+
+// state file of --diff, containers hold arrays up to RB_ARRAY_MAX entries
+#define RB_MAGIC "cscanrb1"
+#define RB_ARRAY_MAX 4096
+
+// compressed output, blocks queued for the writer thread and how long a
+// partly filled block may wait
+#define LOGZ_QUEUE 16
+#define LOGZ_FLUSH_SECS 1
+
+// daemon / control socket limits
+#define MAX_CLIENTS 64
+#define MAX_JOBS 4096
+#define LINE_MAX_LEN 256
+
+struct client {
+    int fd;
+    char in[LINE_MAX_LEN];
+    unsigned int in_len;
+    char *out;
+    size_t out_len, out_max;
 };
 
-struct connection conns[MAX_SOCKS];
+// a daemon job, its index is the job number the scanner sees
+struct job {
+    unsigned long id; // 0 = free
+    int client;       // -1 once the client went away
+    unsigned long results;
+};
+
+cscan_t *scanner;
 FILE *logfd;
-unsigned int timeout = 5;
-unsigned int socks_nr = 256;
 int verbose = 0;
-unsigned long found = 0;
+int log_all = 0;
+int log_rtt = 0;
+int busy_cpu = -1; // pinned CPU in busy poll mode
+cscan_replay_t *replay; // answers come from a capture
+char log_buf[LOG_BUF_SIZE];
+unsigned int log_len = 0;
+volatile sig_atomic_t interrupted; // SIGINT came, clean up from the loop
+
+char *daemon_path, *control_path;
+int serve_fd = -1;
+time_t start_time;
+struct client clients[MAX_CLIENTS];
+struct job jobs[MAX_JOBS];
+unsigned long job_seq = 0;
+
+struct pcap_rec {
+    uint32_t ts_sec, ts_usec, incl_len, orig_len;
+};
+
+// a held packet, in a pool shared by all probes
+struct pcap_pkt {
+    int next; // in the probe's list or the free list, -1 = end
+    struct pcap_rec rec;
+    unsigned char data[PCAP_SNAPLEN];
+};
+
+// a probe's packets, held until its outcome is known
+struct pcap_hold {
+    uint64_t key; // ip << 16 | port, 0 = free
+    int pass;     // open, further packets go straight out
+    int first, last;
+    time_t seen;
+};
+
+struct pcap_state {
+    int fd, lo_idx, open_only;
+    uint32_t first_ip, last_ip;
+    unsigned int first_port, last_port;
+    // --pcap-open: probes by ip:port (open addressing), their packets
+    struct pcap_hold *hold;
+    unsigned int hold_mask, hold_used, hold_idle;
+    struct pcap_pkt *pkts;
+    int pkt_free;
+    time_t swept;
+    unsigned long held_dropped;
+
+    // ring between the scanner and the writer thread, indexes only grow;
+    // the writer sleeps on ready, a full ring drops instead of waiting
+    char *ring;
+    atomic_size_t head, tail;
+    atomic_int done;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    size_t kicked; // head the writer was last woken for
+    unsigned long packets, dropped; // by the scanner thread
+
+    // files, written by the writer thread only
+    char *path;
+    FILE *fp;
+    unsigned long size_max, size, rotations;
+    unsigned int files;
+} pcap = {.fd = -1,
+           .files = 4,
+           .lock = PTHREAD_MUTEX_INITIALIZER,
+           .ready = PTHREAD_COND_INITIALIZER};
+
+// a blocked Bloom filter, all bits of a key are in one 512 bit block
+struct dedup_stage {
+    uint64_t (*blocks)[8];
+    uint64_t nblocks;
+    unsigned long cap, nr;
+    unsigned int k;
+};
+
+// filters are stacked as they fill up, each with half the false positive
+// rate of the one before, so the total stays below fp; past size_max the
+// oldest are dropped
+struct dedup_state {
+    double fp; // 0 = off
+    struct dedup_stage stage[DEDUP_STAGES];
+    unsigned int stages, aged;
+    unsigned long dups;
+    size_t size, size_max;
+} dedup = {.size_max = (size_t)DEDUP_MEM << 20};
+
+struct db_state {
+    int fd;
+    unsigned char *map;
+    uint32_t file_units;
+} db = {.fd = -1};
 
-// clean connection structure
-void clean_struct(struct connection *sc) {
-    if (sc->sock) {
-        shutdown(sc->sock, SHUT_RDWR);
-        close(sc->sock);
-        sc->sock = 0;
+struct rb_header {
+    char magic[8];
+    uint32_t nr; // containers
+    uint32_t unused;
+    uint64_t card; // open ports
+    uint64_t dir_off;
+};
+
+// a container: the open ports of one port and /16, sorted by key
+struct rb_dir {
+    uint32_t key; // port << 16 | ip >> 16
+    uint32_t card;
+    uint64_t off; // of the array or bitmap in the file
+};
+
+struct diff_state {
+    const char *path; // NULL = off
+    unsigned char *map;
+    size_t map_size;
+    struct rb_header *hdr; // NULL = no previous run
+    struct rb_dir *dir;
+    uint32_t *port_dir; // first container of each port, 65537 entries
+    uint64_t *opened, *closed; // port << 32 | ip
+    unsigned long opened_nr, opened_max, closed_nr, closed_max;
+    unsigned long unchanged;
+    uint64_t saved_nr, saved_size;
+    unsigned long saved_containers;
+} diff;
+
+struct logz_state {
+    int on;
+    unsigned char (*blocks)[LOGZ_BLOCK];
+    uint32_t lens[LOGZ_QUEUE];
+    atomic_size_t head, tail; // blocks handed over / written, only grow
+    atomic_int done;
+    pthread_t writer;
+    // each side sleeps on its condition until the other moves head or tail
+    pthread_mutex_t lock;
+    pthread_cond_t ready, room; // a block queued / written
+
+    // the block being filled, by the scanner thread
+    uint32_t len, prev_ip;
+    time_t pushed;
+    unsigned long waits;
+
+    // by the writer thread
+    uint64_t raw, written;
+    double cpu_ms;
+} logz = {.lock = PTHREAD_MUTEX_INITIALIZER,
+          .ready = PTHREAD_COND_INITIALIZER,
+          .room = PTHREAD_COND_INITIALIZER};
+
+/*
+ * Packet capture (--pcap). A packet socket sees the TCP traffic of the
+ * box; packets to or from the scanned ranges are copied into a
+ * preallocated ring by the scanner thread and written out by a writer
+ * thread, so a slow disk never holds up the scan (a full ring drops
+ * packets instead). Files are rotated by size: path, path.1, ... up to
+ * pcap.files of them.
+ */
+void pcap_header(FILE *fp) {
+    uint32_t hdr[6] = {0xa1b2c3d4, 0x00040002, 0, 0, PCAP_SNAPLEN,
+                       PCAP_LINKTYPE_RAW};
+
+    fwrite(hdr, sizeof(hdr), 1, fp);
+}
+
+// start a new file, shifting the older ones down
+void pcap_rotate(void) {
+    char from[PATH_MAX], to[PATH_MAX];
+    unsigned int i;
+
+    if (pcap.fp) {
+        fclose(pcap.fp);
+        for (i = pcap.files - 1; i; i--) {
+            snprintf(to, sizeof(to), "%s.%u", pcap.path, i);
+            if (i == 1)
+                snprintf(from, sizeof(from), "%s", pcap.path);
+            else
+                snprintf(from, sizeof(from), "%s.%u", pcap.path, i - 1);
+            rename(from, to);
+        }
+        pcap.rotations++;
+    }
+    if (!(pcap.fp = fopen(pcap.path, "w"))) {
+        perror("Cannot open/create pcap file");
+        exit(EXIT_FAILURE);
     }
-    sc->status = STATUS_NONE;
-    sc->conn_time = 0;
-    memset(&(sc->caddr), 0, sizeof(struct sockaddr));
+    pcap_header(pcap.fp);
+    pcap.size = 24;
 }
 
-int connect_to(struct connection *sc) {
-    int sock, flags, flags_old;
+void *pcap_writer(void *arg) {
+    struct pcap_rec *rec;
+    size_t head, tail, pos, len;
+    int done;
 
-    // create socket
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) {
-        perror("Cannot create socket");
-        return -1;
+    for (;;) {
+        pthread_mutex_lock(&pcap.lock);
+        while (!(done = atomic_load(&pcap.done)) &&
+               (atomic_load_explicit(&pcap.head, memory_order_acquire) ==
+                atomic_load_explicit(&pcap.tail, memory_order_relaxed)))
+            pthread_cond_wait(&pcap.ready, &pcap.lock);
+        pthread_mutex_unlock(&pcap.lock);
+        // done is read first: nothing is queued after it, so this head is
+        // the last one
+        head = atomic_load_explicit(&pcap.head, memory_order_acquire);
+        tail = atomic_load_explicit(&pcap.tail, memory_order_relaxed);
+        while (tail != head) {
+            // a record never wraps, the rest of the ring is skipped instead
+            pos = tail % PCAP_RING_SIZE;
+            rec = (struct pcap_rec *)(pcap.ring + pos);
+            if ((PCAP_RING_SIZE - pos < sizeof(*rec)) ||
+                (rec->incl_len == UINT32_MAX)) {
+                tail += PCAP_RING_SIZE - pos;
+                continue;
+            }
+            len = sizeof(*rec) + rec->incl_len;
+            if (pcap.size_max && (pcap.size + len > pcap.size_max)) pcap_rotate();
+            fwrite(rec, len, 1, pcap.fp);
+            pcap.size += len;
+            tail += len;
+        }
+        atomic_store_explicit(&pcap.tail, tail, memory_order_release);
+        if (done) break;
+        fflush(pcap.fp);
     }
+    fclose(pcap.fp);
+    return NULL;
+}
 
-    // set non-blocking mode
-    flags_old = fcntl(sock, F_GETFL, 0);
-    flags = flags_old;
-    flags |= O_NONBLOCK;
-    if (fcntl(sock, F_SETFL, flags) == -1) {
-        perror("Cannot set non-blocking socket");
-        return -1;
+// wake the writer for what was queued since it was last woken
+void pcap_kick(void) {
+    size_t head = atomic_load_explicit(&pcap.head, memory_order_relaxed);
+
+    if (head == pcap.kicked) return;
+    pcap.kicked = head;
+    pthread_mutex_lock(&pcap.lock);
+    pthread_cond_signal(&pcap.ready);
+    pthread_mutex_unlock(&pcap.lock);
+}
+
+// copy a packet into the ring, dropping it if the writer is behind
+void pcap_queue(struct pcap_rec *rec, const unsigned char *data) {
+    size_t head, tail, pos, need, skip = 0;
+
+    need = sizeof(*rec) + rec->incl_len;
+    head = atomic_load_explicit(&pcap.head, memory_order_relaxed);
+    tail = atomic_load_explicit(&pcap.tail, memory_order_acquire);
+    pos = head % PCAP_RING_SIZE;
+    if (PCAP_RING_SIZE - pos < need) skip = PCAP_RING_SIZE - pos;
+    if (head + skip + need - tail > PCAP_RING_SIZE) {
+        pcap.dropped++;
+        return;
+    }
+    if (skip) {
+        if (skip >= sizeof(*rec))
+            ((struct pcap_rec *)(pcap.ring + pos))->incl_len = UINT32_MAX;
+        head += skip;
+        pos = 0;
+    }
+    memcpy(pcap.ring + pos, rec, sizeof(*rec));
+    memcpy(pcap.ring + pos + sizeof(*rec), data, rec->incl_len);
+    atomic_store_explicit(&pcap.head, head + need, memory_order_release);
+    pcap.packets++;
+}
+
+// the entry of key, or the free one where it would go
+struct pcap_hold *pcap_hold_find(uint64_t key) {
+    unsigned int i = (key * 0x9e3779b97f4a7c15ULL) >> 32 & pcap.hold_mask;
+
+    while (pcap.hold[i].key && (pcap.hold[i].key != key))
+        i = (i + 1) & pcap.hold_mask;
+    return &pcap.hold[i];
+}
+
+// free an entry and its packets, shifting back the rest of its chain
+void pcap_hold_del(struct pcap_hold *h) {
+    unsigned int i = h - pcap.hold, j = i, k;
+
+    if (h->first != -1) {
+        pcap.pkts[h->last].next = pcap.pkt_free;
+        pcap.pkt_free = h->first;
+    }
+    for (;;) {
+        j = (j + 1) & pcap.hold_mask;
+        if (!pcap.hold[j].key) break;
+        k = (pcap.hold[j].key * 0x9e3779b97f4a7c15ULL) >> 32 & pcap.hold_mask;
+        if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+            continue;
+        pcap.hold[i] = pcap.hold[j];
+        i = j;
+    }
+    pcap.hold[i].key = 0;
+    pcap.hold_used--;
+}
+
+// let go of probes nothing was heard of for a while: open ones done
+// talking, and stray packets of probes whose outcome is already out
+void pcap_hold_sweep(time_t now) {
+    unsigned int i;
+
+    pcap.swept = now;
+    for (i = 0; i <= pcap.hold_mask;)
+        if (pcap.hold[i].key && (now - pcap.hold[i].seen > pcap.hold_idle))
+            pcap_hold_del(&pcap.hold[i]); // may shift another entry into i
+        else
+            i++;
+}
+
+// keep a packet of a probe whose outcome is not known yet; a probe starts
+// with its SYN, anything else of an unknown probe comes after its outcome.
+// alt is the probe the packet may be the answer of, see pcap_match().
+void pcap_hold(uint64_t key, uint64_t alt, int syn, struct pcap_rec *rec,
+               const unsigned char *data) {
+    struct pcap_hold *h;
+    struct pcap_pkt *pkt;
+    int n;
+
+    if (rec->ts_sec - pcap.swept > 1) pcap_hold_sweep(rec->ts_sec);
+    h = pcap_hold_find(key);
+    if (!h->key && alt && !syn) h = pcap_hold_find(alt);
+    if (!h->key) {
+        if (!syn) return;
+        // at most 3/4 full, so the probe chains stay short
+        if (pcap.hold_used >= (pcap.hold_mask + 1) / 4 * 3) {
+            pcap.held_dropped++;
+            return;
+        }
+        h->key = key;
+        h->pass = 0;
+        h->first = h->last = -1;
+        pcap.hold_used++;
+    }
+    h->seen = rec->ts_sec;
+    if (h->pass) {
+        pcap_queue(rec, data);
+        return;
+    }
+    if ((n = pcap.pkt_free) == -1) {
+        pcap.held_dropped++;
+        return;
+    }
+    pkt = &pcap.pkts[n];
+    pcap.pkt_free = pkt->next;
+    pkt->next = -1;
+    pkt->rec = *rec;
+    memcpy(pkt->data, data, rec->incl_len);
+    if (h->first == -1)
+        h->first = n;
+    else
+        pcap.pkts[h->last].next = n;
+    h->last = n;
+}
+
+// ip:port and whether it is one of ours, from an IPv4 TCP packet; syn is
+// set for a SYN to the target. When both ends are in the scanned ranges
+// (e.g. on loopback) key is the destination and alt the source, else 0.
+int pcap_match(const unsigned char *pkt, size_t len, uint64_t *key,
+               uint64_t *alt, int *syn) {
+    const struct iphdr *ip = (const struct iphdr *)pkt;
+    const struct tcphdr *tcp;
+    uint32_t src, dst;
+
+    if ((len < sizeof(*ip)) || (ip->version != 4) ||
+        (len < ip->ihl * 4 + sizeof(*tcp)))
+        return 0;
+    tcp = (const struct tcphdr *)(pkt + ip->ihl * 4);
+    src = ntohl(ip->saddr);
+    dst = ntohl(ip->daddr);
+    *alt = 0;
+    *syn = 0;
+    if ((src >= pcap.first_ip) && (src <= pcap.last_ip) &&
+        (ntohs(tcp->source) >= pcap.first_port) &&
+        (ntohs(tcp->source) <= pcap.last_port))
+        *alt = ((uint64_t)src << 16) | ntohs(tcp->source);
+    if ((dst >= pcap.first_ip) && (dst <= pcap.last_ip) &&
+        (ntohs(tcp->dest) >= pcap.first_port) &&
+        (ntohs(tcp->dest) <= pcap.last_port)) {
+        *key = ((uint64_t)dst << 16) | ntohs(tcp->dest);
+        *syn = tcp->syn && !tcp->ack;
+        return 1;
+    }
+    if (!*alt) return 0;
+    *key = *alt;
+    *alt = 0;
+    return 1;
+}
+
+// take everything the packet socket has
+void pcap_read(void) {
+    static unsigned char bufs[PCAP_BATCH][PCAP_SNAPLEN];
+    static char cbufs[PCAP_BATCH][CMSG_SPACE(sizeof(struct timeval))];
+    struct mmsghdr msgs[PCAP_BATCH];
+    struct iovec iovs[PCAP_BATCH];
+    struct sockaddr_ll lls[PCAP_BATCH];
+    struct cmsghdr *cm;
+    struct pcap_rec rec;
+    struct timeval tv;
+    uint64_t key, alt;
+    int i, n, syn;
+
+    if (pcap.fd == -1) return;
+    do {
+        for (i = 0; i < PCAP_BATCH; i++) {
+            iovs[i].iov_base = bufs[i];
+            iovs[i].iov_len = PCAP_SNAPLEN;
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &lls[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(lls[i]);
+            msgs[i].msg_hdr.msg_control = cbufs[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(cbufs[i]);
+        }
+        // MSG_TRUNC: the length is that of the whole packet
+        n = recvmmsg(pcap.fd, msgs, PCAP_BATCH, MSG_DONTWAIT | MSG_TRUNC, NULL);
+        for (i = 0; i < n; i++) {
+            // loopback shows every packet twice, once each way
+            if ((lls[i].sll_pkttype == PACKET_OUTGOING) &&
+                (lls[i].sll_ifindex == pcap.lo_idx))
+                continue;
+            rec.orig_len = msgs[i].msg_len;
+            rec.incl_len = (rec.orig_len < PCAP_SNAPLEN) ? rec.orig_len
+                                                         : PCAP_SNAPLEN;
+            if (!pcap_match(bufs[i], rec.incl_len, &key, &alt, &syn)) continue;
+            gettimeofday(&tv, NULL);
+            for (cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm;
+                 cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm))
+                if ((cm->cmsg_level == SOL_SOCKET) &&
+                    (cm->cmsg_type == SCM_TIMESTAMP))
+                    memcpy(&tv, CMSG_DATA(cm), sizeof(tv));
+            rec.ts_sec = tv.tv_sec;
+            rec.ts_usec = tv.tv_usec;
+            if (pcap.open_only)
+                pcap_hold(key, alt, syn, &rec, bufs[i]);
+            else
+                pcap_queue(&rec, bufs[i]);
+        }
+    } while (n == PCAP_BATCH);
+    pcap_kick();
+}
+
+// a probe has its outcome, with --pcap-open its packets go out if open
+void pcap_result(uint32_t ip, unsigned int port, int outcome) {
+    uint64_t key = ((uint64_t)ip << 16) | port;
+    struct pcap_hold *h;
+    int i;
+
+    if ((pcap.fd == -1) || !pcap.open_only) return;
+    pcap_read(); // the answer may still sit in the socket
+    h = pcap_hold_find(key);
+    if (!h->key) return;
+    if (outcome != CSCAN_OPEN) {
+        pcap_hold_del(h);
+        return;
+    }
+    for (i = h->first; i != -1; i = pcap.pkts[i].next)
+        pcap_queue(&pcap.pkts[i].rec, pcap.pkts[i].data);
+    if (h->first != -1) {
+        pcap.pkts[h->last].next = pcap.pkt_free;
+        pcap.pkt_free = h->first;
+    }
+    h->first = h->last = -1;
+    h->pass = 1;
+    pcap_kick();
+}
+
+// sockets and timeout size and age the held probes of --pcap-open
+void pcap_open(const char *path, unsigned int sockets, unsigned int timeout) {
+    // IPv4 TCP only, the rest never leaves the kernel
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0x40000),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+    int one = 1, size = 4 << 20, i;
+    unsigned int n;
+
+    pcap.fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK, htons(ETH_P_IP));
+    if (pcap.fd == -1) {
+        perror("Cannot open packet socket (needs CAP_NET_RAW)");
+        exit(EXIT_FAILURE);
+    }
+    if (setsockopt(pcap.fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+                   sizeof(prog)) == -1) {
+        perror("Cannot attach capture filter");
+        exit(EXIT_FAILURE);
+    }
+    setsockopt(pcap.fd, SOL_SOCKET, SO_TIMESTAMP, &one, sizeof(one));
+    setsockopt(pcap.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    pcap.lo_idx = if_nametoindex("lo");
+
+    pcap.path = strdup(path);
+    pcap.ring = malloc(PCAP_RING_SIZE);
+    if (!pcap.path || !pcap.ring) {
+        perror("Cannot allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    if (pcap.open_only) {
+        // probes in flight, retries and answers still coming in
+        for (n = 1; n < sockets * 4;) n <<= 1;
+        pcap.hold_mask = n - 1;
+        pcap.hold = calloc(n, sizeof(*pcap.hold));
+        pcap.pkts = malloc(sockets * PCAP_HOLD_PKTS * sizeof(*pcap.pkts));
+        if (!pcap.hold || !pcap.pkts) {
+            perror("Cannot allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < sockets * PCAP_HOLD_PKTS; i++) pcap.pkts[i].next = i + 1;
+        pcap.pkts[i - 1].next = -1;
+        pcap.pkt_free = 0;
+        pcap.hold_idle = timeout + PCAP_HOLD_IDLE;
+        pcap.swept = time(0);
+    }
+    pcap_rotate();
+    if (pthread_create(&pcap.writer, NULL, pcap_writer, NULL)) {
+        fprintf(stderr, "Cannot start pcap writer.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// write out what is left and stop the writer
+void pcap_close(void) {
+    if (pcap.fd == -1) return;
+    pcap_read();
+    close(pcap.fd);
+    pcap.fd = -1;
+    pthread_mutex_lock(&pcap.lock);
+    atomic_store(&pcap.done, 1);
+    pthread_cond_signal(&pcap.ready);
+    pthread_mutex_unlock(&pcap.lock);
+    pthread_join(pcap.writer, NULL);
+    if (verbose || pcap.dropped)
+        printf("Captured %lu packets, %lu dropped, %lu rotations\n",
+               pcap.packets, pcap.dropped, pcap.rotations);
+    if (pcap.held_dropped)
+        printf("Held packets dropped %lu (--pcap-open out of room)\n",
+               pcap.held_dropped);
+}
+
+/*
+ * Duplicate results (--dedup). Overlapping targets, e.g. a range added
+ * twice over the control socket, give the same result twice; the lines
+ * written are kept in a Bloom filter and repeats dropped. A false positive
+ * drops a line that was not written before, at a rate of at most fp.
+ */
+// forget the oldest lines, their repeats are written again
+void dedup_age(void) {
+    free(dedup.stage[0].blocks);
+    dedup.size -= dedup.stage[0].nblocks * sizeof(*dedup.stage[0].blocks);
+    memmove(dedup.stage, dedup.stage + 1,
+            --dedup.stages * sizeof(*dedup.stage));
+    dedup.aged++;
+}
+
+// add a filter for cap more keys, making room below size_max first by
+// dropping old filters or, with one left, taking fewer keys; -1 if there
+// is no memory for one
+int dedup_grow(unsigned long cap) {
+    struct dedup_stage *st;
+    double fp, bits;
+
+    for (;;) {
+        if (dedup.stages == DEDUP_STAGES) dedup_age();
+        st = &dedup.stage[dedup.stages];
+        fp = dedup.fp / (2UL << dedup.stages);
+        // k = log2(1 / fp) bits set per key, k / ln 2 bits per key; uneven
+        // blocks cost accuracy, more so with many bits a key, which takes up
+        // to half as many bits again (measured to stay below fp)
+        for (st->k = 0; fp < 1; fp *= 2) st->k++;
+        if (st->k > 24) st->k = 24;
+        bits = st->k * 1.4427 * (1 + st->k / 48.0);
+        st->nblocks = (uint64_t)(cap * bits / 512) + 1;
+        if (dedup.size + st->nblocks * sizeof(*st->blocks) <= dedup.size_max)
+            break;
+        if (dedup.stages > 1)
+            dedup_age();
+        else if (cap > DEDUP_MIN)
+            cap /= 2;
+        else
+            break;
     }
+    if (!(st->blocks = calloc(st->nblocks, sizeof(*st->blocks)))) return -1;
+    st->cap = cap;
+    st->nr = 0;
+    dedup.size += st->nblocks * sizeof(*st->blocks);
+    dedup.stages++;
+    return 0;
+}
 
-    // connect to given host
-    connect(sock, (struct sockaddr *)&(sc->caddr), sizeof(struct sockaddr));
-    sc->sock = sock;
-    sc->status = STATUS_CONNECTING;
-    sc->conn_time = time(0);
+int dedup_test(struct dedup_stage *st, uint64_t h, int set) {
+    uint64_t *b = st->blocks[(unsigned __int128)h * st->nblocks >> 64];
+    uint64_t x = h;
+    unsigned int i, bit;
+    int found = 1;
 
+    // 9 fresh bits per position, 7 of them from each hash
+    for (i = 0; i < st->k; i++, x >>= 9) {
+        if (!(i % 7)) x = cscan_mix64(h + i);
+        bit = x & 511;
+        if (!(b[bit >> 6] & (1ULL << (bit & 63)))) {
+            if (!set) return 0;
+            found = 0;
+            b[bit >> 6] |= 1ULL << (bit & 63);
+        }
+    }
+    return found;
+}
+
+// 1 if the line was written before, else remember it
+int dedup_seen(uint32_t ip, unsigned int port, int outcome) {
+    uint64_t h = cscan_mix64(((uint64_t)outcome << 48) | ((uint64_t)ip << 16) | port);
+    struct dedup_stage *last;
+    unsigned int i;
+
+    for (i = 0; i + 1 < dedup.stages; i++)
+        if (dedup_test(&dedup.stage[i], h, 0)) goto dup;
+    last = &dedup.stage[dedup.stages - 1];
+    if (dedup_test(last, h, 1)) goto dup;
+    // full, the next one takes the new keys; without memory this one does
+    if ((++last->nr == last->cap) && (dedup_grow(last->cap * 2) == -1))
+        dedup.stage[dedup.stages - 1].cap = ~0UL;
     return 0;
+
+dup:
+    dedup.dups++;
+    return 1;
+}
+
+/*
+ * Result database (--db), see cscan-db.h. Every result of the scan updates
+ * it in place: open sets the address' bit, any other outcome clears it.
+ * The file is mapped once with room to grow and extended DB_GROW units at
+ * a time as ports and /16s show up.
+ */
+void db_open(const char *path) {
+    struct db_header *h;
+    struct stat sb;
+
+    if ((db.fd = open(path, O_RDWR | O_CREAT, 0644)) == -1) {
+        perror("Cannot open/create database");
+        exit(EXIT_FAILURE);
+    }
+    // one writer at a time, readers do without
+    if (flock(db.fd, LOCK_EX | LOCK_NB) == -1) {
+        perror("Database is in use");
+        exit(EXIT_FAILURE);
+    }
+    if (fstat(db.fd, &sb) == -1) {
+        perror("Cannot stat database");
+        exit(EXIT_FAILURE);
+    }
+    if (!sb.st_size && (ftruncate(db.fd, DB_HEADER_UNITS * DB_UNIT) == -1)) {
+        perror("Cannot grow database");
+        exit(EXIT_FAILURE);
+    }
+    db.map = mmap(NULL, DB_MAP_MAX, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_NORESERVE, db.fd, 0);
+    if (db.map == MAP_FAILED) {
+        perror("Cannot map database");
+        exit(EXIT_FAILURE);
+    }
+    h = (struct db_header *)db.map;
+    if (!sb.st_size) {
+        memcpy(h->magic, DB_MAGIC, sizeof(h->magic));
+        h->units = DB_HEADER_UNITS;
+        sb.st_size = DB_HEADER_UNITS * DB_UNIT;
+    }
+    if (memcmp(h->magic, DB_MAGIC, sizeof(h->magic)) ||
+        (h->units < DB_HEADER_UNITS) ||
+        ((uint64_t)h->units * DB_UNIT > (uint64_t)sb.st_size)) {
+        fprintf(stderr, "%s is not a cscan database.\n", path);
+        exit(EXIT_FAILURE);
+    }
+    db.file_units = sb.st_size / DB_UNIT;
+}
+
+// n fresh, zeroed units
+uint32_t db_alloc(uint32_t n) {
+    struct db_header *h = (struct db_header *)db.map;
+    uint32_t unit = h->units;
+
+    if ((uint64_t)(unit + n) * DB_UNIT > DB_MAP_MAX) {
+        fprintf(stderr, "Database is full.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (unit + n > db.file_units) {
+        db.file_units = unit + n + DB_GROW;
+        if (ftruncate(db.fd, (off_t)db.file_units * DB_UNIT) == -1) {
+            perror("Cannot grow database");
+            exit(EXIT_FAILURE);
+        }
+    }
+    h->units += n;
+    return unit;
+}
+
+void db_record(uint32_t ip, unsigned int port, int open) {
+    struct db_header *h = (struct db_header *)db.map;
+    uint32_t *table;
+    uint64_t *bits;
+
+    if (!(bits = db_bitmap(db.map, h->units, port, ip))) {
+        // nothing open there so far
+        if (!open) return;
+        if (!h->ports[port]) h->ports[port] = db_alloc(DB_TABLE_UNITS);
+        table = (uint32_t *)(db.map + (uint64_t)h->ports[port] * DB_UNIT);
+        table[ip >> 16] = db_alloc(1);
+        bits = (uint64_t *)(db.map + (uint64_t)table[ip >> 16] * DB_UNIT);
+    }
+    if (open)
+        bits[(ip & 0xffff) >> 6] |= 1ULL << (ip & 63);
+    else
+        bits[(ip & 0xffff) >> 6] &= ~(1ULL << (ip & 63));
+}
+
+void db_close(void) {
+    if (db.fd == -1) return;
+    munmap(db.map, DB_MAP_MAX);
+    close(db.fd);
+    db.fd = -1;
+}
+
+/*
+ * Differential scans (--diff). The open ports of the last run are kept in
+ * a file of roaring style containers, one per port and /16, holding the
+ * low 16 bits of the addresses as a sorted array while there are at most
+ * RB_ARRAY_MAX of them, else as a bitmap. The file is mapped and searched
+ * in place, results that differ from it are the only output, and at the
+ * end the changes are merged into a new file for the next run.
+ */
+uint64_t diff_key(uint32_t ip, unsigned int port) {
+    return ((uint64_t)port << 32) | ip;
 }
 
-void verif_sock(struct connection *sc) {
-    int conret;
-    // timeout for connecting socket
-    if ((sc->status == STATUS_CONNECTING) &&
-        ((time(0) - sc->conn_time) >= timeout)) {
-        clean_struct(&(*sc));
+void diff_load(const char *path) {
+    struct stat sb;
+    uint32_t port, i;
+    uint64_t len;
+    int fd;
+
+    diff.path = path;
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        if (errno == ENOENT) return; // first run, everything is new
+        perror("Cannot open diff state");
+        exit(EXIT_FAILURE);
+    }
+    if (fstat(fd, &sb) == -1) {
+        perror("Cannot stat diff state");
+        exit(EXIT_FAILURE);
+    }
+    if (sb.st_size < sizeof(struct rb_header)) goto bad;
+    diff.map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (diff.map == MAP_FAILED) {
+        perror("Cannot map diff state");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    diff.map_size = sb.st_size;
+    diff.hdr = (struct rb_header *)diff.map;
+    if (memcmp(diff.hdr->magic, RB_MAGIC, sizeof(diff.hdr->magic)) ||
+        (diff.hdr->dir_off > diff.map_size) ||
+        (diff.hdr->dir_off % _Alignof(struct rb_dir)) ||
+        ((diff.map_size - diff.hdr->dir_off) / sizeof(struct rb_dir) <
+         diff.hdr->nr))
+        goto bad;
+    diff.dir = (struct rb_dir *)(diff.map + diff.hdr->dir_off);
+    // every container in the file and sorted, lookups then trust the map
+    for (i = 0; i < diff.hdr->nr; i++) {
+        len = diff.dir[i].card > RB_ARRAY_MAX ? 8192 : diff.dir[i].card * 2ULL;
+        if (!diff.dir[i].card || (diff.dir[i].card > 65536) ||
+            (diff.dir[i].off % _Alignof(uint16_t)) ||
+            (diff.dir[i].off > diff.map_size) ||
+            (len > diff.map_size - diff.dir[i].off) ||
+            (i && (diff.dir[i].key <= diff.dir[i - 1].key)))
+            goto bad;
+    }
+    if (!(diff.port_dir = malloc(65537 * sizeof(*diff.port_dir)))) {
+        perror("Cannot allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    for (port = 0, i = 0; port <= 65536; port++) {
+        while ((i < diff.hdr->nr) && ((diff.dir[i].key >> 16) < port)) i++;
+        diff.port_dir[port] = i;
+    }
+    return;
+
+bad:
+    fprintf(stderr, "%s is not a cscan diff state.\n", path);
+    exit(EXIT_FAILURE);
+}
+
+// was key open in the last run
+int diff_was_open(uint64_t key) {
+    static uint32_t last[65536]; // container of each port, results come in runs
+    uint32_t c = key >> 16, port = key >> 32, lo, hi, mid;
+    const struct rb_dir *d;
+    const uint16_t *arr;
+    uint16_t low = key;
+
+    if (!diff.hdr || !diff.hdr->nr) return 0;
+    if (diff.dir[last[port]].key != c) {
+        lo = diff.port_dir[port];
+        hi = diff.port_dir[port + 1];
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            if (diff.dir[mid].key < c)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if ((lo == diff.port_dir[port + 1]) || (diff.dir[lo].key != c))
+            return 0;
+        last[port] = lo;
+    }
+    d = &diff.dir[last[port]];
+    arr = (const uint16_t *)(diff.map + d->off);
+    if (d->card > RB_ARRAY_MAX) return (arr[low >> 4] >> (low & 15)) & 1;
+    lo = 0;
+    hi = d->card;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (arr[mid] < low)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < d->card) && (arr[lo] == low);
+}
+
+void diff_push(uint64_t **keys, unsigned long *nr, unsigned long *max,
+               uint64_t key) {
+    if (*nr == *max) {
+        *max = *max ? *max * 2 : 65536;
+        if (!(*keys = realloc(*keys, *max * sizeof(**keys)))) {
+            perror("Cannot allocate memory");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*keys)[(*nr)++] = key;
+}
+
+// 1 if the result differs from the last run
+int diff_changed(uint32_t ip, unsigned int port, int outcome) {
+    uint64_t key = diff_key(ip, port);
+    int was = diff_was_open(key);
+
+    if (outcome == CSCAN_OPEN) {
+        if (was) {
+            diff.unchanged++;
+            return 0;
+        }
+        diff_push(&diff.opened, &diff.opened_nr, &diff.opened_max, key);
+        return 1;
+    }
+    if (!was) return 0;
+    diff_push(&diff.closed, &diff.closed_nr, &diff.closed_max, key);
+    return 1;
+}
+
+// group keys by container, LSD radix sort on key >> 16 in 11 bit digits
+// (few passes, and a scatter to 2048 places still fits the caches);
+// the order within a container does not matter to diff_save()
+void diff_sort(uint64_t *keys, unsigned long nr) {
+    unsigned long count[3][2048] = {{0}}, i, sum, n;
+    uint64_t *tmp, *from = keys, *to, *swap;
+    int d;
+
+    if (nr < 2) return;
+    if (!(tmp = malloc(nr * sizeof(*tmp)))) {
+        perror("Cannot allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < nr; i++)
+        for (d = 0; d < 3; d++) count[d][(keys[i] >> (16 + d * 11)) & 2047]++;
+    to = tmp;
+    for (d = 0; d < 3; d++) {
+        for (i = 0, sum = 0; i < 2048; i++) {
+            n = count[d][i];
+            count[d][i] = sum;
+            sum += n;
+        }
+        for (i = 0; i < nr; i++)
+            to[count[d][(from[i] >> (16 + d * 11)) & 2047]++] = from[i];
+        swap = from;
+        from = to;
+        to = swap;
+    }
+    memcpy(keys, from, nr * sizeof(*keys));
+    free(tmp);
+}
+
+// write container key from bits, if anything is set in it
+void diff_put(FILE *fp, struct rb_dir **dir, unsigned long *nr,
+              unsigned long *max, uint64_t *off, uint32_t key,
+              const uint64_t *bits) {
+    uint16_t arr[RB_ARRAY_MAX];
+    unsigned int i, card = 0;
+    uint64_t x;
+
+    for (i = 0; i < 1024; i++) card += __builtin_popcountll(bits[i]);
+    if (!card) return;
+    if (*nr == *max) {
+        *max = *max ? *max * 2 : 4096;
+        if (!(*dir = realloc(*dir, *max * sizeof(**dir)))) {
+            perror("Cannot allocate memory");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*dir)[*nr].key = key;
+    (*dir)[*nr].card = card;
+    (*dir)[(*nr)++].off = *off;
+    if (card > RB_ARRAY_MAX) {
+        fwrite(bits, 8192, 1, fp);
+        *off += 8192;
         return;
     }
+    for (i = 0, card = 0; i < 1024; i++)
+        for (x = bits[i]; x; x &= x - 1)
+            arr[card++] = (i << 6) | __builtin_ctzll(x);
+    fwrite(arr, sizeof(*arr), card, fp);
+    *off += card * sizeof(*arr);
+}
+
+// merge the changes into the old state and replace it
+void diff_save(void) {
+    static uint64_t bits[1024];
+    struct rb_header hdr = {RB_MAGIC};
+    struct rb_dir *dir = NULL;
+    unsigned long nr = 0, max = 0, i = 0, a = 0, b = 0, old_nr, j;
+    uint32_t key, c;
+    uint64_t off = sizeof(hdr);
+    const uint16_t *arr;
+    char tmp[PATH_MAX];
+    FILE *fp;
+
+    diff_sort(diff.opened, diff.opened_nr);
+    diff_sort(diff.closed, diff.closed_nr);
+    old_nr = diff.hdr ? diff.hdr->nr : 0;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", diff.path);
+    if (!(fp = fopen(tmp, "w"))) {
+        perror("Cannot open/create diff state");
+        exit(EXIT_FAILURE);
+    }
+    setvbuf(fp, NULL, _IOFBF, 1 << 20);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    while ((i < old_nr) || (a < diff.opened_nr) || (b < diff.closed_nr)) {
+        key = ~0U;
+        if (i < old_nr) key = diff.dir[i].key;
+        if ((a < diff.opened_nr) && ((diff.opened[a] >> 16) < key))
+            key = diff.opened[a] >> 16;
+        if ((b < diff.closed_nr) && ((diff.closed[b] >> 16) < key))
+            key = diff.closed[b] >> 16;
+        c = (i < old_nr) && (diff.dir[i].key == key);
+
+        // most containers did not change, they are copied as they are
+        if (c && ((a == diff.opened_nr) || (diff.opened[a] >> 16 != key)) &&
+            ((b == diff.closed_nr) || (diff.closed[b] >> 16 != key))) {
+            j = (diff.dir[i].card > RB_ARRAY_MAX) ? 8192
+                                                  : diff.dir[i].card * 2;
+            if (nr == max) {
+                max = max ? max * 2 : 4096;
+                if (!(dir = realloc(dir, max * sizeof(*dir)))) {
+                    perror("Cannot allocate memory");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            dir[nr] = diff.dir[i++];
+            dir[nr++].off = off;
+            fwrite(diff.map + diff.dir[i - 1].off, 1, j, fp);
+            off += j;
+            continue;
+        }
+
+        memset(bits, 0, sizeof(bits));
+        if (c) {
+            arr = (const uint16_t *)(diff.map + diff.dir[i].off);
+            if (diff.dir[i].card > RB_ARRAY_MAX)
+                memcpy(bits, arr, sizeof(bits));
+            else
+                for (j = 0; j < diff.dir[i].card; j++)
+                    bits[arr[j] >> 6] |= 1ULL << (arr[j] & 63);
+            i++;
+        }
+        for (; (a < diff.opened_nr) && (diff.opened[a] >> 16 == key); a++)
+            bits[(diff.opened[a] & 0xffff) >> 6] |= 1ULL << (diff.opened[a] & 63);
+        for (; (b < diff.closed_nr) && (diff.closed[b] >> 16 == key); b++)
+            bits[(diff.closed[b] & 0xffff) >> 6] &= ~(1ULL << (diff.closed[b] & 63));
+        diff_put(fp, &dir, &nr, &max, &off, key, bits);
+    }
+
+    // the directory is read in place from the map, keep it aligned
+    for (; off % _Alignof(struct rb_dir); off++) fputc(0, fp);
+    hdr.nr = nr;
+    hdr.dir_off = off;
+    for (i = 0; i < nr; i++) hdr.card += dir[i].card;
+    if (nr) fwrite(dir, sizeof(*dir), nr, fp);
+    rewind(fp);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    if (fflush(fp) || fsync(fileno(fp)) || fclose(fp) ||
+        (rename(tmp, diff.path) == -1)) {
+        perror("Cannot write diff state");
+        exit(EXIT_FAILURE);
+    }
+    diff.saved_nr = hdr.card;
+    diff.saved_size = off + nr * sizeof(*dir);
+    diff.saved_containers = nr;
+    free(dir);
+}
+
+/*
+ * Compressed output (--compress). Results are encoded as records straight
+ * into a block (see cscan-log.h) and full blocks are handed to a writer
+ * thread that compresses and writes them, so the scan loop does neither.
+ * It only waits when all LOGZ_QUEUE blocks are still queued.
+ */
+void *logz_writer(void *arg) {
+    static unsigned char out[LOGZ_BOUND(LOGZ_BLOCK)];
+    struct logz_block b;
+    struct timespec ts;
+    size_t head, tail;
+    unsigned char *src;
 
-    // connect again, parse errors and log the result
-    conret = connect(sc->sock, (struct sockaddr *)&(sc->caddr),
-                     sizeof(struct sockaddr));
-    if ((conret == -1) && (errno != EALREADY) && (errno != EINPROGRESS))
-        clean_struct(&(*sc));
-    else if (((conret == -1) && (errno == EISCONN)) || (conret == 0)) {
-        if (logfd)
-            fprintf(logfd, "%s:%u\n", inet_ntoa(sc->caddr.sin_addr),
-                    ntohs(sc->caddr.sin_port));
-        if ((verbose && logfd) || (!logfd))
-            printf("Open %s:%u    \n", inet_ntoa(sc->caddr.sin_addr),
-                   ntohs(sc->caddr.sin_port));
+    for (;;) {
+        pthread_mutex_lock(&logz.lock);
+        while (((head = atomic_load_explicit(&logz.head, memory_order_acquire)) ==
+                (tail = atomic_load_explicit(&logz.tail, memory_order_relaxed))) &&
+               !atomic_load(&logz.done))
+            pthread_cond_wait(&logz.ready, &logz.lock);
+        pthread_mutex_unlock(&logz.lock);
+        if (head == tail) break; // done
+        for (; tail != head; tail++) {
+            src = logz.blocks[tail % LOGZ_QUEUE];
+            b.raw_len = logz.lens[tail % LOGZ_QUEUE];
+            b.len = logz_compress(src, b.raw_len, out);
+            if (b.len >= b.raw_len) b.len = b.raw_len;
+            fwrite(&b, sizeof(b), 1, logfd);
+            fwrite((b.len == b.raw_len) ? src : out, 1, b.len, logfd);
+            logz.raw += b.raw_len;
+            logz.written += sizeof(b) + b.len;
+            pthread_mutex_lock(&logz.lock);
+            atomic_store_explicit(&logz.tail, tail + 1, memory_order_release);
+            pthread_cond_signal(&logz.room);
+            pthread_mutex_unlock(&logz.lock);
+        }
         fflush(logfd);
-        found++;
-        clean_struct(&(*sc));
     }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    logz.cpu_ms = ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+    return NULL;
+}
 
-    return;
+// hand the block over and start the next one
+void logz_push(void) {
+    size_t head = atomic_load_explicit(&logz.head, memory_order_relaxed);
+
+    logz.lens[head % LOGZ_QUEUE] = logz.len;
+    logz.len = 0;
+    logz.prev_ip = 0;
+    pthread_mutex_lock(&logz.lock);
+    atomic_store_explicit(&logz.head, head + 1, memory_order_release);
+    pthread_cond_signal(&logz.ready);
+    // the next block to fill is still queued, sleep until it is written
+    if (head + 1 - atomic_load_explicit(&logz.tail, memory_order_acquire) >=
+        LOGZ_QUEUE) {
+        logz.waits++;
+        while (head + 1 - atomic_load_explicit(&logz.tail,
+                                               memory_order_acquire) >=
+               LOGZ_QUEUE)
+            pthread_cond_wait(&logz.room, &logz.lock);
+    }
+    pthread_mutex_unlock(&logz.lock);
+    logz.pushed = time(0); // after a wait too, or the flush pushes right away
+}
+
+void logz_result(uint32_t ip, unsigned int port, int outcome,
+                 unsigned long rtt_us, const char *info) {
+    struct logz_rec r = {ip, port, outcome, 0, rtt_us, info, 0};
+    unsigned char *p;
+
+    if (logz.len > LOGZ_BLOCK - LOGZ_REC_MAX) logz_push();
+    if (log_all || diff.path) r.flags |= LOGZ_STATE;
+    if (log_rtt && rtt_us) r.flags |= LOGZ_RTT;
+    if (info && *info) {
+        r.flags |= LOGZ_INFO;
+        r.info_len = strnlen(info, LOGZ_INFO_MAX);
+    }
+    p = logz.blocks[atomic_load_explicit(&logz.head, memory_order_relaxed) %
+                    LOGZ_QUEUE];
+    logz.len = logz_put(p + logz.len, &logz.prev_ip, &r) - p;
+}
+
+// start the writer on logfd, which is empty or compressed output too
+void logz_open(void) {
+    fwrite(LOGZ_MAGIC, sizeof(LOGZ_MAGIC) - 1, 1, logfd);
+    if (!(logz.blocks = malloc(LOGZ_QUEUE * sizeof(*logz.blocks)))) {
+        perror("Cannot allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    logz.pushed = time(0);
+    if ((errno = pthread_create(&logz.writer, NULL, logz_writer, NULL))) {
+        perror("Cannot start output writer");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// write out what is left and stop the writer
+void logz_close(void) {
+    if (!logz.blocks) return;
+    if (logz.len) logz_push();
+    pthread_mutex_lock(&logz.lock);
+    atomic_store(&logz.done, 1);
+    pthread_cond_signal(&logz.ready);
+    pthread_mutex_unlock(&logz.lock);
+    pthread_join(logz.writer, NULL);
+    free(logz.blocks);
+    logz.blocks = NULL;
+}
+
+// open -o for appending, a log goes on in the format it was started in
+void log_open(const char *path) {
+    char magic[sizeof(LOGZ_MAGIC) - 1];
+    int compressed;
+
+    if (!(logfd = fopen(path, "a+"))) {
+        perror("Cannot open/create log file");
+        exit(EXIT_FAILURE);
+    }
+    fseek(logfd, 0, SEEK_END);
+    if (ftell(logfd) > 0) {
+        rewind(logfd);
+        compressed = (fread(magic, sizeof(magic), 1, logfd) == 1) &&
+                     !memcmp(magic, LOGZ_MAGIC, sizeof(magic));
+        if (compressed && !logz.on) {
+            fprintf(stderr, "Cannot append a text log to compressed output, "
+                            "add --compress.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!compressed && logz.on) {
+            fprintf(stderr, "Cannot append compressed output to a text log.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (logz.on) logz_open();
+}
+
+// write out the batched results
+void log_flush(void) {
+    if (logz.on) {
+        if (logz.len && (time(0) - logz.pushed >= LOGZ_FLUSH_SECS)) logz_push();
+        return;
+    }
+    if (!log_len) return;
+    if (logfd) {
+        fwrite(log_buf, 1, log_len, logfd);
+        fflush(logfd);
+    }
+    log_len = 0;
+}
+
+// append "ip:port[ outcome][ rtt][ info]" to the output batch
+void log_result(uint32_t ip, unsigned int port, int outcome,
+                unsigned long rtt_us, const char *info) {
+    char *p;
+    int i;
+
+    if (logz.on) {
+        logz_result(ip, port, outcome, rtt_us, info);
+        return;
+    }
+    if (log_len > LOG_BUF_SIZE - 256) log_flush();
+    p = log_buf + log_len;
+    for (i = 24; i >= 0; i -= 8) {
+        p += sprintf(p, "%u", (ip >> i) & 0xff);
+        *p++ = i ? '.' : ':';
+    }
+    p += sprintf(p, "%u", port);
+    if (log_all || diff.path)
+        p += sprintf(p, " %s", cscan_outcome_name(outcome));
+    if (log_rtt && rtt_us) p += sprintf(p, " %luus", rtt_us);
+    if (info && *info) p += sprintf(p, " %.160s", info);
+    *p++ = '\n';
+    log_len = p - log_buf;
+}
+
+// result callback of the scanner
+void on_result(const struct cscan_result *res, void *arg) {
+    struct in_addr addr;
+
+    pcap_result(res->ip, res->port, res->outcome);
+    if (db.fd != -1) db_record(res->ip, res->port, res->outcome == CSCAN_OPEN);
+    if (diff.path) {
+        if (!diff_changed(res->ip, res->port, res->outcome)) return;
+        if (res->outcome != CSCAN_OPEN) {
+            if (logfd)
+                log_result(res->ip, res->port, res->outcome, 0, NULL);
+            if ((verbose && logfd) || !logfd) {
+                addr.s_addr = htonl(res->ip);
+                printf("Closed %s:%u %s    \n", inet_ntoa(addr), res->port,
+                       cscan_outcome_name(res->outcome));
+            }
+            return;
+        }
+    }
+    if (dedup.fp && (log_all || (res->outcome == CSCAN_OPEN)) &&
+        dedup_seen(res->ip, res->port, res->outcome))
+        return;
+    if (logfd && (log_all || (res->outcome == CSCAN_OPEN)))
+        log_result(res->ip, res->port, res->outcome, res->rtt_us, res->info);
+    if ((res->outcome == CSCAN_OPEN) && ((verbose && logfd) || (!logfd))) {
+        addr.s_addr = htonl(res->ip);
+        if (log_rtt)
+            printf("Open %s:%u %luus %s    \n", inet_ntoa(addr), res->port,
+                   res->rtt_us, res->info ? res->info : "");
+        else
+            printf("Open %s:%u %s    \n", inet_ntoa(addr), res->port,
+                   res->info ? res->info : "");
+    }
+}
+
+// how long to wait for completions: up to the next timeout, max_ms at most
+int wait_time(int max_ms) {
+    long next;
+
+    // spin, completions are picked up the moment they arrive
+    if (busy_cpu != -1) return 0;
+    next = cscan_next_timeout(scanner);
+
+    return ((next != -1) && (next < max_ms)) ? next : max_ms;
+}
+
+// queue a line for a daemon client
+void client_printf(struct client *c, const char *fmt, ...) {
+    va_list ap;
+    int len;
+
+    for (;;) {
+        va_start(ap, fmt);
+        len = vsnprintf(c->out + c->out_len, c->out_max - c->out_len, fmt, ap);
+        va_end(ap);
+        if (c->out_len + len < c->out_max) break;
+        c->out_max = c->out_max ? c->out_max * 2 : 4096;
+        if (!(c->out = realloc(c->out, c->out_max))) {
+            perror("Cannot allocate memory");
+            exit(EXIT_FAILURE);
+        }
+    }
+    c->out_len += len;
+}
+
+void client_flush(struct client *c) {
+    ssize_t n;
+
+    if (!c->out_len) return;
+    n = write(c->fd, c->out, c->out_len);
+    if (n <= 0) return;
+    memmove(c->out, c->out + n, c->out_len - n);
+    c->out_len -= n;
+}
+
+void client_close(int ci) {
+    struct client *c = &clients[ci];
+    int j;
+
+    for (j = 0; j < MAX_JOBS; j++)
+        if (jobs[j].id && (jobs[j].client == ci)) jobs[j].client = -1;
+    close(c->fd);
+    free(c->out);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+// result callback in daemon mode, streams results to the job's client
+void daemon_result(const struct cscan_result *res, void *arg) {
+    struct job *j = &jobs[res->job];
+
+    if (logfd && (log_all || (res->outcome == CSCAN_OPEN)))
+        log_result(res->ip, res->port, res->outcome, res->rtt_us, res->info);
+    j->results++;
+    if (j->client == -1) return;
+    client_printf(&clients[j->client], "result %lu %u.%u.%u.%u:%u %s%s%s\n",
+                  j->id, res->ip >> 24, (res->ip >> 16) & 0xff,
+                  (res->ip >> 8) & 0xff, res->ip & 0xff, res->port,
+                  cscan_outcome_name(res->outcome), res->info ? " " : "",
+                  res->info ? res->info : "");
+}
+
+void daemon_job_done(unsigned long job, void *arg) {
+    struct job *j = &jobs[job];
+
+    if (j->client != -1)
+        client_printf(&clients[j->client], "done %lu %lu\n", j->id,
+                      j->results);
+    j->id = 0;
+}
+
+// parse "<ip[/n]> <port[-port]>" from a command
+int parse_target(struct client *c, char *args, uint32_t *first_ip,
+                 uint32_t *last_ip, unsigned int *first_port,
+                 unsigned int *last_port) {
+    char hosts[64], ports[32];
+
+    if ((sscanf(args, "%63s %31s", hosts, ports) != 2) ||
+        (cscan_parse_hosts(hosts, first_ip, last_ip) == -1) ||
+        (cscan_parse_ports(ports, first_port, last_port) == -1)) {
+        client_printf(c, "error invalid target\n");
+        return -1;
+    }
+    return 0;
+}
+
+// "scan <ip[/n]> <port[-port]>", a new job in daemon mode
+void cmd_scan(int ci, char *args) {
+    struct client *c = &clients[ci];
+    uint32_t first_ip, last_ip;
+    unsigned int first_port, last_port, j;
+
+    if (parse_target(c, args, &first_ip, &last_ip, &first_port, &last_port) ==
+        -1)
+        return;
+    for (j = 0; (j < MAX_JOBS) && jobs[j].id; j++)
+        ;
+    if (j == MAX_JOBS) {
+        client_printf(c, "error too many jobs\n");
+        return;
+    }
+    jobs[j].id = ++job_seq;
+    jobs[j].client = ci;
+    jobs[j].results = 0;
+    client_printf(c, "job %lu\n", jobs[j].id);
+    if (cscan_add_job(scanner, j, first_ip, last_ip, first_port, last_port) ==
+        -1) {
+        client_printf(c, "error %s\n", cscan_error(scanner));
+        jobs[j].id = 0;
+    }
+}
+
+// "add <ip[/n]> <port[-port]>", append a target to the running scan
+void cmd_add(int ci, char *args) {
+    struct client *c = &clients[ci];
+    uint32_t first_ip, last_ip;
+    unsigned int first_port, last_port;
+
+    if (parse_target(c, args, &first_ip, &last_ip, &first_port, &last_port) ==
+        -1)
+        return;
+    if (cscan_add_target(scanner, first_ip, last_ip, first_port, last_port) ==
+        -1)
+        client_printf(c, "error %s\n", cscan_error(scanner));
+    else
+        client_printf(c, "ok\n");
+}
+
+void cmd_status(struct client *c) {
+    struct cscan_stats st;
+
+    cscan_get_stats(scanner, &st);
+    client_printf(c,
+                  "status total %" PRIu64 " started %" PRIu64
+                  " saved %lu inflight %u open %lu closed %lu filtered %lu"
+                  " unreachable %lu errors %lu retries %lu dead %lu"
+                  " rate %u sockets %u paused %d allocs %lu elapsed %lu\n",
+                  st.total, st.started, st.probes_saved, st.inflight,
+                  st.outcomes[CSCAN_OPEN], st.outcomes[CSCAN_CLOSED],
+                  st.outcomes[CSCAN_FILTERED], st.outcomes[CSCAN_UNREACH],
+                  st.outcomes[CSCAN_ERROR], st.retries_sent, st.dead_hosts,
+                  st.rate, st.sockets, st.paused, st.allocs,
+                  (unsigned long)(time(0) - start_time));
+}
+
+// one command line from a daemon or control client
+void client_line(int ci, char *line) {
+    struct client *c = &clients[ci];
+    char cmd[16] = "", *args;
+    unsigned int n;
+
+    sscanf(line, "%15s", cmd);
+    args = line + strspn(line, " \t");
+    args += strcspn(args, " \t");
+
+    if (!strcmp(cmd, "scan") && daemon_path)
+        cmd_scan(ci, args);
+    else if (!strcmp(cmd, "add") && !daemon_path)
+        cmd_add(ci, args);
+    else if (!strcmp(cmd, "rate") && (sscanf(args, "%u", &n) == 1)) {
+        cscan_set_rate(scanner, n);
+        client_printf(c, "ok\n");
+    } else if (!strcmp(cmd, "sockets") && (sscanf(args, "%u", &n) == 1)) {
+        if (cscan_set_sockets(scanner, n) == -1)
+            client_printf(c, "error sockets must be 1-%u\n", CSCAN_MAX_SOCKS);
+        else
+            client_printf(c, "ok\n");
+    } else if (!strcmp(cmd, "pause") || !strcmp(cmd, "resume")) {
+        cscan_pause(scanner, !strcmp(cmd, "pause"));
+        client_printf(c, "ok\n");
+    } else if (!strcmp(cmd, "status"))
+        cmd_status(c);
+    else if (*cmd)
+        client_printf(c, "error commands: %s, rate <n>, sockets <n>, pause, "
+                         "resume, status\n",
+                      daemon_path ? "scan <ip[/n]> <port[-port]>"
+                                  : "add <ip[/n]> <port[-port]>");
+}
+
+void client_read(int ci) {
+    struct client *c = &clients[ci];
+    char *nl;
+    ssize_t n;
+
+    n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len - 1);
+    if (n <= 0) {
+        client_close(ci);
+        return;
+    }
+    c->in_len += n;
+    c->in[c->in_len] = 0;
+    while ((nl = strchr(c->in, '\n'))) {
+        *nl = 0;
+        client_line(ci, c->in);
+        c->in_len -= nl + 1 - c->in;
+        memmove(c->in, nl + 1, c->in_len + 1);
+    }
+    if (c->in_len == sizeof(c->in) - 1) {
+        client_printf(c, "error line too long\n");
+        c->in_len = 0;
+    }
+}
+
+// listen for daemon or control clients on a unix socket
+void serve_open(const char *path) {
+    struct sockaddr_un addr;
+    int i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+    if (((serve_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) ||
+        (bind(serve_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) ||
+        (listen(serve_fd, 64) == -1)) {
+        perror("Cannot listen on unix socket");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < MAX_CLIENTS; i++) clients[i].fd = -1;
+    signal(SIGPIPE, SIG_IGN);
+}
+
+/*
+ * Wait up to timeout ms for the scanner, serving clients meanwhile. All
+ * client I/O is non-blocking, so a slow client never holds up the scan.
+ */
+void serve_wait(int timeout) {
+    struct pollfd pfds[MAX_CLIENTS + 3], *p;
+    int fd, i, n = 0, first, cidx[MAX_CLIENTS + 3];
+
+    pfds[n].fd = cscan_fd(scanner);
+    pfds[n++].events = POLLIN;
+    // the capture is read on every pass, it only needs to wake us
+    if (pcap.fd != -1) {
+        pfds[n].fd = pcap.fd;
+        pfds[n++].events = POLLIN;
+    }
+    first = n;
+    if (serve_fd != -1) {
+        pfds[n].fd = serve_fd;
+        pfds[n++].events = POLLIN;
+        for (i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i].fd == -1) continue;
+            client_flush(&clients[i]);
+            cidx[n] = i;
+            pfds[n].fd = clients[i].fd;
+            pfds[n++].events = POLLIN | (clients[i].out_len ? POLLOUT : 0);
+        }
+    }
+    // interrupted by SIGINT, revents are not to be trusted
+    fd = poll(pfds, n, timeout);
+    pcap_read();
+    if ((serve_fd == -1) || (fd == -1)) return;
+
+    if (pfds[first].revents & POLLIN) {
+        while ((fd = accept(serve_fd, NULL, NULL)) != -1) {
+            for (i = 0; (i < MAX_CLIENTS) && (clients[i].fd != -1); i++)
+                ;
+            if (i == MAX_CLIENTS) {
+                close(fd);
+                continue;
+            }
+            clients[i].fd = fd;
+        }
+    }
+    for (p = pfds + first + 1; p < pfds + n; p++) {
+        if (p->revents & POLLOUT) client_flush(&clients[cidx[p - pfds]]);
+        if (p->revents & (POLLIN | POLLHUP | POLLERR))
+            client_read(cidx[p - pfds]);
+    }
+}
+
+// SIGINT only raises the flag, the loops run _cleanup() from normal context
+void on_sigint(int none) { interrupted = 1; }
+
+void _cleanup(void) {
+    puts("Ok, cleaning up, please wait...\n");
+    cscan_finish(scanner);
+    log_flush();
+    logz_close();
+    pcap_close();
+    db_close();
+    if (diff.path) diff_save();
+    if (daemon_path) unlink(daemon_path);
+    if (control_path) unlink(control_path);
+    puts("Done.\n");
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Serve scan jobs on a unix socket. Every job shares the scanner and its
+ * socket budget, and results go back to the client as they come in:
+ *
+ *   > scan 192.168.1.1 1-1024
+ *   < job 1
+ *   < result 1 192.168.1.1:22 open
+ *   < ...
+ *   < done 1 1024
+ */
+void run_daemon(int verif_sock_time) {
+    serve_open(daemon_path);
+    cscan_set_callback(scanner, daemon_result, NULL);
+    cscan_set_job_callback(scanner, daemon_job_done, NULL);
+    if (verbose) printf("Waiting for jobs on %s\n", daemon_path);
+
+    for (;;) {
+        serve_wait(wait_time(verif_sock_time));
+        if (interrupted) _cleanup();
+        if (cscan_step(scanner) == -1)
+            fprintf(stderr, "%s\n", cscan_error(scanner));
+        log_flush();
+    }
+}
+
+// run on cpu only, the spinning loop then has it to itself
+void pin_cpu(int cpu) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if ((cpu < 0) || (cpu >= CPU_SETSIZE) ||
+        (sched_setaffinity(0, sizeof(set), &set) == -1)) {
+        perror("Cannot pin to CPU");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// CPU time spent on the scan, to weigh busy polling against waiting
+void cpu_report(struct cscan_stats *st) {
+    struct rusage ru;
+    unsigned long probes = st->started + st->retries_sent;
+    double user, sys;
+
+    if (getrusage(RUSAGE_SELF, &ru) == -1) return;
+    user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    printf("CPU user %.2fs, sys %.2fs, %.1f us per probe\n", user, sys,
+           probes ? (user + sys) * 1e6 / probes : 0);
+}
+
+// throughput of a --replay, loading the capture and running it apart
+void replay_report(struct timespec *ts, struct cscan_stats *st) {
+    struct cscan_replay_stats rst;
+    double load, run;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts[2]);
+    cscan_replay_get_stats(replay, &rst);
+    load = (ts[1].tv_sec - ts[0].tv_sec) + (ts[1].tv_nsec - ts[0].tv_nsec) / 1e9;
+    run = (ts[2].tv_sec - ts[1].tv_sec) + (ts[2].tv_nsec - ts[1].tv_nsec) / 1e9;
+    printf("Capture %lu packets (%lu skipped), %lu probes, %lu responses, "
+           "%lu bytes of payload\n",
+           rst.packets, rst.skipped, rst.probes, rst.answers, rst.bytes);
+    printf("Loaded in %.3fs, replayed %lu probes in %.3fs, %.0f responses/sec "
+           "(%.0f probes/sec)\n",
+           load, (unsigned long)(st->started + st->retries_sent), run,
+           rst.answers / (load + run),
+           (st->started + st->retries_sent) / run);
+}
+
+void diff_report(struct timespec *ts) {
+    printf("Diff: %lu opened, %lu closed, %lu still open; loaded in %.1f ms\n",
+           diff.opened_nr, diff.closed_nr, diff.unchanged,
+           (ts[1].tv_sec - ts[0].tv_sec) * 1e3 +
+               (ts[1].tv_nsec - ts[0].tv_nsec) / 1e6);
+    printf("State %lu open in %lu containers, %.1f MB, saved in %.1f ms\n",
+           (unsigned long)diff.saved_nr, diff.saved_containers,
+           diff.saved_size / 1048576.0,
+           (ts[3].tv_sec - ts[2].tv_sec) * 1e3 +
+               (ts[3].tv_nsec - ts[2].tv_nsec) / 1e6);
 }
 
 void usage(char *this) {
@@ -136,11 +1751,40 @@ void usage(char *this) {
            "  Options:\n"
            "    -h <n>   Host/s [e.g. 192.168.1.0/24]\n"
            "    -o <n>   Output file\n"
+           "    -a       Log every outcome with its state to the output file\n"
            "    -p <n>   Port/s to scan.\n"
            "    -t <n>   Timeout seconds [default 5]\n"
            "    -s <n>   Parallel sockets [default 256]\n"
-           "    -m <n>   Internal sleep time [default 500ms]\n"
+           "    -m <n>   Max internal sleep time [default 500ms]\n"
+           "    -d <n>   Drop host after n consecutive timeouts [default off]\n"
+           "    -H <n>   Max probes in flight per host [default off]\n"
+           "    -N <n>   Max probes in flight per /24 [default off]\n"
+           "    -r <n>   Retries for timed out probes [default 0, max 8]\n"
+           "    -b <n>   Retry backoff, doubled per retry [default 500ms]\n"
            "    -v       Verbose.\n"
+           "    --source-ip <ip[/n],...>  Spread probes over source addresses\n"
+           "    --teardown <close|rst>    Close probes normally or with RST\n"
+           "    --shard <i/N>             Scan slice i of N (1 <= i <= N)\n"
+           "    --randomize               Scan ip x port in random order\n"
+           "    --seed <n>                Seed of the random order [default 0]\n"
+           "    --rate <n>                Max new probes per second [default off]\n"
+           "    --daemon <path>           Serve scan jobs on a unix socket\n"
+           "    --control <path>          Control socket for this scan\n"
+           "    --probe <banner|http|smtp> Talk to open ports, log what they say\n"
+           "    --huge-pages              Keep scanner state on huge pages\n"
+           "    --kernel-timeout          Let the kernel time out connects\n"
+           "    --busy-poll <cpu>         Pin to cpu and spin for exact RTTs\n"
+           "    --rtt                     Log the connect RTT of every answer\n"
+           "    --pcap <file>             Capture the probes' packets to file\n"
+           "    --pcap-open               Capture only probes of open ports\n"
+           "    --pcap-size <n>           Rotate the capture every n MB\n"
+           "    --pcap-files <n>          Capture files kept [default 4]\n"
+           "    --replay <file>           Answer probes from a capture, no network\n"
+           "    --dedup <fp>              Drop repeated results, wrongly at rate fp\n"
+           "    --dedup-mem <n>           Max MB of the dedup filter [default 256]\n"
+           "    --db <file>               Keep open ports in a bitmap database\n"
+           "    --diff <file>             Report only changes since the last run\n"
+           "    --compress                Write -o compressed, read by cscan-merge\n"
            "\n"
            "  Examples:\n"
            "    %s -p 1-1000 -v -s 512 -t 2 -h 192.168.0.2\n"
@@ -150,180 +1794,381 @@ void usage(char *this) {
     exit(0);
 }
 
-void _cleanup(int none) {
-    int x;
-    puts("Ok, cleaning up, please wait...\n");
-    for (x = 0; x < MAX_SOCKS; x++) {
-        verif_sock(&conns[x]);
-        clean_struct(&conns[x]);
-    }
-    puts("Done.\n");
-    exit(EXIT_SUCCESS);
-}
-
 int main(int argc, char *argv[]) {
-    unsigned long n_ip, h_ip, current_ip, end_ip;
-    unsigned long mask = 0xffffffff;
-    char *mask_slash, *port_char;
+    uint32_t h_ip, end_ip;
+    unsigned int start_port, end_port;
     char hosts[256] = "", outfile[256] = "", port_range[64] = "";
-    unsigned long start_port, current_port, end_port;
-    int x, verif_sock_time = 500;
-    unsigned long progress, etc, _total;
-    float total;
-    time_t start_time = time(0);
+    char *sources = NULL, *pcap_path = NULL, *replay_path = NULL;
+    char *db_path = NULL;
+    struct timespec diff_ts[4];
+    struct cscan_replay_stats rst;
+    struct timespec replay_ts[3];
+    int x, ret, verif_sock_time = 500;
+    unsigned long etc, _total, stats_time, stats_probes = 0;
+    uint64_t shown = ~0ULL;
     struct in_addr plm;
+    struct cscan_config cfg;
+    struct cscan_stats st;
+    static struct option long_opts[] = {
+        {"source-ip", required_argument, 0, OPT_SOURCE_IP},
+        {"teardown", required_argument, 0, OPT_TEARDOWN},
+        {"shard", required_argument, 0, OPT_SHARD},
+        {"randomize", no_argument, 0, OPT_RANDOMIZE},
+        {"seed", required_argument, 0, OPT_SEED},
+        {"daemon", required_argument, 0, OPT_DAEMON},
+        {"control", required_argument, 0, OPT_CONTROL},
+        {"rate", required_argument, 0, OPT_RATE},
+        {"probe", required_argument, 0, OPT_PROBE},
+        {"huge-pages", no_argument, 0, OPT_HUGE_PAGES},
+        {"kernel-timeout", no_argument, 0, OPT_KERNEL_TIMEOUT},
+        {"busy-poll", required_argument, 0, OPT_BUSY_POLL},
+        {"rtt", no_argument, 0, OPT_RTT},
+        {"pcap", required_argument, 0, OPT_PCAP},
+        {"pcap-open", no_argument, 0, OPT_PCAP_OPEN},
+        {"pcap-size", required_argument, 0, OPT_PCAP_SIZE},
+        {"pcap-files", required_argument, 0, OPT_PCAP_FILES},
+        {"replay", required_argument, 0, OPT_REPLAY},
+        {"dedup", required_argument, 0, OPT_DEDUP},
+        {"db", required_argument, 0, OPT_DB},
+        {"diff", required_argument, 0, OPT_DIFF},
+        {"compress", no_argument, 0, OPT_COMPRESS},
+        {"dedup-mem", required_argument, 0, OPT_DEDUP_MEM},
+        {0, 0, 0, 0}};
 
     if (argc < 2) usage(argv[0]);
+    start_time = time(0);
+    cscan_config_init(&cfg);
 
     // parse cmd line
-    while ((x = getopt(argc, argv, "h:p:s:o:m:t:v")) != -1) {
+    while ((x = getopt_long(argc, argv, "h:p:s:o:m:t:d:H:N:r:b:av",
+                            long_opts, NULL)) != -1) {
         switch (x) {
         case 'h': strcpy(hosts, optarg); break;
         case 'm': verif_sock_time = atoi(optarg); break;
+        case 'd': cfg.dead_after = atoi(optarg); break;
+        case 'H': cfg.host_cap = atoi(optarg); break;
+        case 'N': cfg.net_cap = atoi(optarg); break;
+        case 'r': cfg.retries = atoi(optarg); break;
+        case 'b': cfg.backoff = atoi(optarg); break;
         case 'o': strcpy(outfile, optarg); break;
-        case 't': timeout = atoi(optarg); break;
+        case 't': cfg.timeout = atoi(optarg); break;
         case 'v': verbose = 1; break;
+        case 'a': log_all = 1; break;
         case 'p': strcpy(port_range, optarg); break;
-        case 's': socks_nr = atoi(optarg); break;
+        case 's': cfg.sockets = atoi(optarg); break;
+        case OPT_SOURCE_IP: sources = optarg; break;
+        case OPT_TEARDOWN:
+            if (!strcmp(optarg, "rst"))
+                cfg.teardown = CSCAN_TEARDOWN_RST;
+            else if (!strcmp(optarg, "close"))
+                cfg.teardown = CSCAN_TEARDOWN_CLOSE;
+            else {
+                fprintf(stderr, "Teardown must be `close' or `rst'.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_SHARD:
+            if ((sscanf(optarg, "%" SCNu64 "/%" SCNu64, &cfg.shard_idx,
+                        &cfg.shard_nr) != 2) ||
+                !cfg.shard_idx || (cfg.shard_idx > cfg.shard_nr)) {
+                fprintf(stderr, "Shard must be i/N with 1 <= i <= N.\n");
+                exit(EXIT_FAILURE);
+            }
+            cfg.shard_idx--;
+            break;
+        case OPT_RANDOMIZE: cfg.randomize = 1; break;
+        case OPT_SEED: cfg.seed = strtoull(optarg, NULL, 0); break;
+        case OPT_DAEMON: daemon_path = optarg; break;
+        case OPT_CONTROL: control_path = optarg; break;
+        case OPT_RATE: cfg.rate = atoi(optarg); break;
+        case OPT_HUGE_PAGES: cfg.huge_pages = 1; break;
+        case OPT_KERNEL_TIMEOUT: cfg.kernel_timeout = 1; break;
+        case OPT_BUSY_POLL:
+            busy_cpu = atoi(optarg);
+            cfg.busy_poll = BUSY_POLL_US;
+            break;
+        case OPT_RTT: log_rtt = 1; break;
+        case OPT_PCAP: pcap_path = optarg; break;
+        case OPT_PCAP_OPEN: pcap.open_only = 1; break;
+        case OPT_PCAP_SIZE: pcap.size_max = strtoul(optarg, NULL, 10) << 20; break;
+        case OPT_REPLAY: replay_path = optarg; break;
+        case OPT_DB: db_path = optarg; break;
+        case OPT_DIFF: diff.path = optarg; break;
+        case OPT_COMPRESS: logz.on = 1; break;
+        case OPT_DEDUP:
+            dedup.fp = atof(optarg);
+            if ((dedup.fp <= 0) || (dedup.fp >= 1)) {
+                fprintf(stderr, "Dedup false positive rate must be in (0, 1).\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_DEDUP_MEM:
+            if (atof(optarg) <= 0) {
+                fprintf(stderr, "Dedup memory must be above 0 MB.\n");
+                exit(EXIT_FAILURE);
+            }
+            dedup.size_max = atof(optarg) * 1048576;
+            break;
+        case OPT_PCAP_FILES:
+            if ((pcap.files = atoi(optarg)) < 1) {
+                fprintf(stderr, "Keep at least one capture file.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_PROBE:
+            if (!strcmp(optarg, "banner"))
+                cfg.probe = CSCAN_PROBE_BANNER;
+            else if (!strcmp(optarg, "http"))
+                cfg.probe = CSCAN_PROBE_HTTP;
+            else if (!strcmp(optarg, "smtp"))
+                cfg.probe = CSCAN_PROBE_SMTP;
+            else {
+                fprintf(stderr, "Probe must be `banner', `http' or `smtp'.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
         default: printf("Try `%s' for usage.\n", argv[0]); exit(0);
         }
     }
 
     // set intrerrupt signal
-    signal(SIGINT, _cleanup);
-
-    // calculate netmask (ip range)
-    if ((mask_slash = strchr(hosts, '/'))) {
-        *mask_slash = 0;
-        mask_slash++;
-    }
-    if (mask_slash) mask <<= (32 - atol(mask_slash));
+    signal(SIGINT, on_sigint);
 
-    n_ip = inet_addr(hosts);
-    h_ip = ntohl(n_ip);
-    end_ip = h_ip | ~mask;
-    current_ip = h_ip;
+    if (busy_cpu != -1) pin_cpu(busy_cpu);
 
-    // calculate port range
-    port_char = strchr(port_range, '-');
-    if (port_char) {
-        *port_char = 0;
-        port_char++;
-        end_port = atol(port_char);
+    // verify some stuff
+    if (cfg.sockets > CSCAN_MAX_SOCKS) {
+        fprintf(stderr, "Max sockets number is %u.\n", CSCAN_MAX_SOCKS);
+        exit(EXIT_FAILURE);
     }
-    start_port = atol(port_range);
-    current_port = start_port;
-    if (!port_char) end_port = start_port;
-    if (start_port > end_port) {
-        fprintf(stderr, "Invalid port range.\n");
+    if (cfg.retries > CSCAN_MAX_RETRIES) {
+        fprintf(stderr, "Max retries number is %u.\n", CSCAN_MAX_RETRIES);
+        exit(EXIT_FAILURE);
+    }
+    if ((verif_sock_time / 1000) > cfg.timeout) {
+        fprintf(stderr, "Internal sleep time cannot be above timeout value.\n");
         exit(EXIT_FAILURE);
     }
 
-    // clean struct array
-    for (x = 0; x < MAX_SOCKS; x++) clean_struct(&conns[x]);
-
-    // calculate total connections
-    etc = end_port - start_port + 1;
-    total = end_ip - h_ip + 1.00000;
-    total *= etc;
-    progress = 0;
-    _total = end_ip - h_ip + 1;
-    _total *= etc;
-
-    // verify some stuff
-    if (socks_nr > MAX_SOCKS) {
-        fprintf(stderr, "Max sockets number is 1024.\n");
+    if (daemon_path &&
+        (pcap_path || replay_path || dedup.fp || db_path || diff.path)) {
+        fprintf(stderr, "No packet capture, replay, dedup, database or diff "
+                        "in daemon mode.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (logz.on && !*outfile) {
+        fprintf(stderr, "Nothing to compress without -o.\n");
         exit(EXIT_FAILURE);
     }
-    if (socks_nr > _total) socks_nr = _total;
-    if (inet_addr(hosts) == -1) {
+    if (pcap_path && replay_path) {
+        fprintf(stderr, "Cannot capture a replay.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (daemon_path) {
+        if (!(scanner = cscan_new(&cfg))) {
+            perror("Cannot create scanner");
+            exit(EXIT_FAILURE);
+        }
+        if (sources && (cscan_add_sources(scanner, sources) == -1)) {
+            fprintf(stderr, "%s.\n", cscan_error(scanner));
+            exit(EXIT_FAILURE);
+        }
+        if (*outfile) log_open(outfile);
+        run_daemon(verif_sock_time);
+    }
+
+    // the capture is read in full first, its range is the default target
+    if (replay_path) {
+        clock_gettime(CLOCK_MONOTONIC, &replay_ts[0]);
+        if (!(replay = cscan_replay_new(replay_path))) {
+            perror("Cannot read capture");
+            exit(EXIT_FAILURE);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &replay_ts[1]);
+        cscan_replay_get_stats(replay, &rst);
+        if (!rst.probes) {
+            fprintf(stderr, "No probes in the capture.\n");
+            exit(EXIT_FAILURE);
+        }
+        h_ip = rst.first_ip;
+        end_ip = rst.last_ip;
+        start_port = rst.first_port;
+        end_port = rst.last_port;
+    }
+    if ((!replay || *hosts) && (cscan_parse_hosts(hosts, &h_ip, &end_ip) == -1)) {
         fprintf(stderr, "Invalid IP address given.\n");
         exit(EXIT_FAILURE);
     }
-    if ((end_port > 65534) || (end_port < 1)) {
+    if ((!replay || *port_range) &&
+        (cscan_parse_ports(port_range, &start_port, &end_port) == -1)) {
         fprintf(stderr, "Port must be a number within 1-65534\n");
         exit(EXIT_FAILURE);
     }
-    if ((verif_sock_time / 1000) > timeout) {
-        fprintf(stderr, "Internal sleep time cannot be above timeout value.\n");
+
+    if (!(scanner = cscan_new(&cfg))) {
+        perror("Cannot create scanner");
+        exit(EXIT_FAILURE);
+    }
+    if (replay &&
+        (cscan_set_transport(scanner, cscan_replay_transport(), replay) == -1)) {
+        fprintf(stderr, "%s.\n", cscan_error(scanner));
+        exit(EXIT_FAILURE);
+    }
+    if ((cscan_add_target(scanner, h_ip, end_ip, start_port, end_port) == -1) ||
+        (sources && (cscan_add_sources(scanner, sources) == -1))) {
+        fprintf(stderr, "%s.\n", cscan_error(scanner));
+        exit(EXIT_FAILURE);
+    }
+    cscan_set_callback(scanner, on_result, NULL);
+    cscan_get_stats(scanner, &st);
+    if (!st.total) {
+        fprintf(stderr, "Nothing to scan in this shard.\n");
+        exit(EXIT_FAILURE);
+    }
+    _total = st.total;
+    if (dedup.fp &&
+        (dedup_grow(_total < DEDUP_MIN     ? DEDUP_MIN
+                    : _total > DEDUP_FIRST ? DEDUP_FIRST
+                                           : _total) == -1)) {
+        perror("Cannot allocate memory");
         exit(EXIT_FAILURE);
     }
+    if (sources || verbose)
+        printf("Source addresses %u, ephemeral ports %lu, "
+               "capacity %lu connections per target port\n",
+               st.sources ? st.sources : 1, st.ephemeral_ports,
+               st.local_ports);
 
     // where to log
-    if (*outfile) {
-        logfd = fopen(outfile, "a+");
-        if (!logfd) {
-            perror("Cannot open/create log file");
-            exit(EXIT_FAILURE);
-        }
-    }
+    if (*outfile) log_open(outfile);
 
     if (verbose) {
         putchar('\n');
         plm.s_addr = htonl(h_ip);
-        printf("Total hosts to scan %lu (%s - ", end_ip - h_ip + 1,
+        printf("Total hosts to scan %lu (%s - ", end_ip - h_ip + 1UL,
                inet_ntoa(plm));
         plm.s_addr = htonl(end_ip);
         printf("%s)\n", inet_ntoa(plm));
         printf("Total ports to scan %lu (range %u - %u)\n", _total,
                (unsigned short)start_port, (unsigned short)end_port);
-        etc = ((_total / socks_nr) * timeout) + timeout;
+        if (cfg.shard_nr > 1)
+            printf("Shard %" PRIu64 "/%" PRIu64 "\n", cfg.shard_idx + 1,
+                   cfg.shard_nr);
+        etc = ((_total / cfg.sockets) * cfg.timeout) + cfg.timeout;
         printf("Estimated time %lu hours, %lu mins, %lu secs.\n", etc / 3600,
                etc % 3600 ? (etc % 3600) / 60 : etc % 60,
                etc % 3600 ? (etc % 3600) % 60 : etc % 60);
         putchar('\n');
     }
 
-    while (current_ip <= end_ip) {
-        for (x = 0; x < socks_nr; x++) {
-            // if array index is unused, we'll use it
-            if (conns[x].status == STATUS_NONE) {
-                conns[x].caddr.sin_addr.s_addr = htonl(current_ip);
-                conns[x].caddr.sin_port = htons((unsigned short)current_port);
-                conns[x].caddr.sin_family = AF_INET;
-                if (connect_to(&conns[x]) == -1) {
-                    fprintf(stderr,
-                            "Oops, try with `-s < %u'. Sleeping 10secs.\n",
-                            socks_nr);
-                    sleep(10);
-                    break;
-                }
-                progress++;
-                fprintf(stderr, "Open %lu [%0.2f%%]\r", found,
-                        (progress / total) * 100);
-                fflush(stdout);
-                current_port++;
-                if (current_port > end_port) {
-                    current_ip++;
-                    current_port = start_port;
-                }
-            }
-            if (current_ip > end_ip) break;
+    if (pcap_path) {
+        pcap.first_ip = h_ip;
+        pcap.last_ip = end_ip;
+        pcap.first_port = start_port;
+        pcap.last_port = end_port;
+        pcap_open(pcap_path, cfg.sockets, cfg.timeout);
+    }
+    if (db_path) db_open(db_path);
+    if (diff.path) {
+        clock_gettime(CLOCK_MONOTONIC, &diff_ts[0]);
+        diff_load(diff.path);
+        clock_gettime(CLOCK_MONOTONIC, &diff_ts[1]);
+    }
+    if (control_path) serve_open(control_path);
+    stats_time = time(0);
+    while ((ret = cscan_step(scanner))) {
+        if (interrupted) _cleanup();
+        if (ret == -1) {
+            fprintf(stderr, "%s\n", cscan_error(scanner));
+            fprintf(stderr, "Oops, try with `-s < %u'. Sleeping 10secs.\n",
+                    cfg.sockets);
+            sleep(10);
+            continue;
+        }
+        cscan_get_stats(scanner, &st);
+        // only on progress, a busy polling loop comes by far more often
+        if ((st.started + st.probes_saved != shown) || st.paused) {
+            shown = st.started + st.probes_saved;
+            fprintf(stderr, "Open %lu [%0.2f%%]%s\r", st.outcomes[CSCAN_OPEN],
+                    shown * 100.0 / st.total, st.paused ? " paused" : "");
         }
 
-        // prevent 100% cpu usage
-        usleep(verif_sock_time * 1000);
-        for (x = 0; x < socks_nr; x++) verif_sock(&conns[x]);
+        // prevent 100% cpu usage, wake up early when a probe finishes
+        serve_wait(wait_time(verif_sock_time));
+        log_flush();
+
+        // keep an eye on TIME_WAIT and local port pressure
+        if (verbose && (time(0) - stats_time >= STATS_INTERVAL)) {
+            fprintf(stderr,
+                    "\nTIME_WAIT %lu, TCP in use %lu, %0.1f%% of local ports, "
+                    "%lu connects/s\n",
+                    st.tw, st.inuse, (st.inuse + st.tw) * 100.0 / st.local_ports,
+                    (st.started + st.retries_sent - stats_probes) /
+                        (time(0) - stats_time));
+            stats_probes = st.started + st.retries_sent;
+            stats_time = time(0);
+        }
     }
 
     putchar('\n');
 
-    // wait for all socks
+    // wait for the probes still in flight, each until it resolves or times out
     if (verbose) printf("Waiting remaining sockets...\n");
-    sleep(timeout);
-    for (x = 0; x < socks_nr; x++) {
-        verif_sock(&conns[x]);
-        clean_struct(&conns[x]);
+    for (;;) {
+        if (interrupted) _cleanup();
+        // targets added over the control socket start from here too
+        ret = cscan_step(scanner);
+        log_flush();
+        cscan_get_stats(scanner, &st);
+        if (!ret && !st.inflight) break;
+        serve_wait(wait_time(verif_sock_time));
     }
+    cscan_finish(scanner);
+    if (control_path) unlink(control_path);
+    cscan_get_stats(scanner, &st);
 
-    printf("Open %lu [Done]\n", found);
+    log_flush();
+    logz_close();
+    pcap_close();
+    db_close();
+    printf("Open %lu [Done]\n", st.outcomes[CSCAN_OPEN]);
+    if (diff.path) {
+        clock_gettime(CLOCK_MONOTONIC, &diff_ts[2]);
+        diff_save();
+        clock_gettime(CLOCK_MONOTONIC, &diff_ts[3]);
+        diff_report(diff_ts);
+    }
+    if (replay) replay_report(replay_ts, &st);
+    if (dedup.fp && (verbose || dedup.dups))
+        printf("Duplicates dropped %lu, filter %u stages, %.1f MB, %u aged "
+               "out\n",
+               dedup.dups, dedup.stages, dedup.size / 1048576.0, dedup.aged);
+    if (logz.on && (verbose || logz.waits))
+        printf("Output %.1f MB of records written as %.1f MB, compressed in "
+               "%.0f ms, waited for the writer %lu times\n",
+               logz.raw / 1048576.0, logz.written / 1048576.0, logz.cpu_ms,
+               logz.waits);
+    printf("Closed %lu, filtered %lu, unreachable %lu, errors %lu\n",
+           st.outcomes[CSCAN_CLOSED], st.outcomes[CSCAN_FILTERED],
+           st.outcomes[CSCAN_UNREACH], st.outcomes[CSCAN_ERROR]);
+    if (cfg.dead_after)
+        printf("Dead hosts %lu, probes saved %lu\n", st.dead_hosts,
+               st.probes_saved);
+    if (cfg.retries)
+        printf("Retries %lu (recovered %lu, exhausted %lu, dropped %lu)\n",
+               st.retries_sent, st.retries_recovered, st.retries_exhausted,
+               st.retries_dropped);
+    if (verbose || (busy_cpu != -1)) cpu_report(&st);
     if (verbose) {
+        printf("Peak TIME_WAIT %lu, peak TCP in use %lu (system wide)\n",
+               st.peak_tw, st.peak_inuse);
         etc = time(0) - start_time;
         printf("Scan completed in %lu hours, %lu min, %lu secs.\n", etc / 3600,
                etc % 3600 ? (etc % 3600) / 60 : etc % 60,
                etc % 3600 ? (etc % 3600) % 60 : etc % 60);
     }
 
+    cscan_free(scanner);
     if (logfd) fclose(logfd);
     return 0;
 }
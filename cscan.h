@@ -0,0 +1,311 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2008 Alexandru Dreptu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * libcscan, the scanning engine behind cscan.
+ *
+ * A scanner context holds all state of one scan, so any number of them can
+ * run side by side in one process. Typical use:
+ *
+ *     struct cscan_config cfg;
+ *     struct cscan_stats st;
+ *     cscan_t *s;
+ *     int ret;
+ *
+ *     cscan_config_init(&cfg);
+ *     cfg.timeout = 2;
+ *     s = cscan_new(&cfg);
+ *     cscan_set_callback(s, on_result, arg);
+ *     cscan_add_target(s, first_ip, last_ip, 1, 1024);
+ *     do {
+ *         ret = cscan_step(s);
+ *         cscan_get_stats(s, &st);
+ *         poll cscan_fd(s) for reading, at most cscan_next_timeout(s) ms
+ *     } while (ret || st.inflight);
+ *     cscan_finish(s);
+ *     cscan_free(s);
+ *
+ * cscan_step() never blocks, so the context fits in an existing event loop:
+ * add cscan_fd() to it and call cscan_step() when it is readable and on a
+ * timer. Results are delivered through the callback from inside
+ * cscan_step() and cscan_finish(). Functions returning int give -1 on
+ * error, with a message in cscan_error().
+ *
+ * Compiling: gcc -Wall -std=gnu11 -c libcscan.c
+ */
+
+#ifndef CSCAN_H
+#define CSCAN_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CSCAN_MAX_SOCKS 1024
+#define CSCAN_MAX_RETRIES 8
+#define CSCAN_MAX_SOURCES 256
+
+// final outcome of a probe
+#define CSCAN_OPEN 0
+#define CSCAN_CLOSED 1
+#define CSCAN_FILTERED 2
+#define CSCAN_UNREACH 3
+#define CSCAN_ERROR 4
+#define CSCAN_OUTCOME_NR 5
+
+// what is said to open ports once connected
+#define CSCAN_PROBE_NONE 0
+#define CSCAN_PROBE_BANNER 1 // first line the service sends
+#define CSCAN_PROBE_HTTP 2   // status of GET /, following one local redirect
+#define CSCAN_PROBE_SMTP 3   // greeting, EHLO and STARTTLS support
+
+// what backs a context's memory
+#define CSCAN_HUGE_OFF 0 // normal pages
+#define CSCAN_HUGE_TLB 1 // reserved huge pages (MAP_HUGETLB)
+#define CSCAN_HUGE_THP 2 // transparent huge pages, as the kernel manages
+
+// how probe sockets are closed
+#define CSCAN_TEARDOWN_CLOSE 0
+#define CSCAN_TEARDOWN_RST 1
+
+typedef struct cscan cscan_t;
+
+struct cscan_config {
+    unsigned int timeout;    // seconds per probe
+    unsigned int sockets;    // probes in flight
+    unsigned int rate;       // new probes per second, 0 = no limit
+    unsigned int dead_after; // timeouts before a host is dropped, 0 = off
+    unsigned int host_cap;   // probes in flight per host, 0 = off
+    unsigned int net_cap;    // probes in flight per /24, 0 = off
+    unsigned int retries;    // retries of timed out probes
+    unsigned int backoff;    // ms before the first retry, doubled after
+    int teardown;            // CSCAN_TEARDOWN_*
+    uint64_t shard_idx;      // this node's slice, 0 based
+    uint64_t shard_nr;       // slices in total
+    int randomize;           // random ip x port order
+    uint64_t seed;           // seed of the random order
+    int probe;               // CSCAN_PROBE_*, run within the same timeout
+    int huge_pages;          // try to back the context with huge pages
+    int kernel_timeout;      // connects time out in the kernel (sockets only)
+    unsigned int busy_poll;  // SO_BUSY_POLL us on probe sockets, 0 = off
+};
+
+struct cscan_result {
+    uint32_t ip; // host byte order
+    unsigned int port;
+    int outcome; // CSCAN_*
+    unsigned int tries;
+    unsigned long job; // as given to cscan_add_job()
+    const char *info;  // what the probe found on an open port, or NULL
+    unsigned long rtt_us; // connect() to the answer, 0 if none came
+};
+
+struct cscan_stats {
+    uint64_t total;   // probes of all targets (this shard's share)
+    uint64_t started; // new probes started
+    unsigned long outcomes[CSCAN_OUTCOME_NR];
+    unsigned int inflight;
+    unsigned long dead_hosts;
+    unsigned long probes_saved;
+    unsigned long retries_sent;
+    unsigned long retries_recovered;
+    unsigned long retries_exhausted;
+    unsigned long retries_dropped;
+    unsigned int sources;          // source addresses, 0 = default route
+    unsigned long ephemeral_ports; // size of ip_local_port_range
+    unsigned long local_ports;     // ephemeral ports x source addresses
+    unsigned long tw, inuse;   // last TIME_WAIT / TCP in use sample
+    unsigned long peak_tw, peak_inuse;
+    unsigned int rate, sockets; // current limits
+    int paused;
+    unsigned long allocs;     // heap allocations by the engine so far
+    unsigned long arena_size; // bytes mapped for the context at cscan_new()
+    int huge_pages;           // CSCAN_HUGE_* the arena ended up on
+};
+
+typedef void (*cscan_result_cb)(const struct cscan_result *res, void *arg);
+typedef void (*cscan_job_cb)(unsigned long job, void *arg);
+
+/*
+ * The transport under the engine. Probes are named by their slot, 0 up to
+ * cfg.sockets - 1, with at most one probe per slot at a time. The default
+ * is non-blocking sockets watched by epoll; cscan_sim_transport() below is
+ * an in-memory one for testing and benchmarking the scheduler.
+ */
+struct cscan_completion {
+    unsigned int slot;
+    int err; // 0 if connected, else an errno value as SO_ERROR reports it
+};
+
+struct cscan_transport {
+    // start connecting slot to ip:port (host order) from src, 0 = any;
+    // -1 with errno set on failure
+    int (*connect)(void *ctx, unsigned int slot, uint32_t ip,
+                   unsigned int port, uint32_t src);
+    // finished connections, at most max of them, never blocks
+    int (*poll)(void *ctx, struct cscan_completion *done, int max);
+    // release a slot, with a RST instead of a FIN if rst is set
+    void (*close)(void *ctx, unsigned int slot, int rst);
+    // the clock probe timeouts and retries run on, in ms
+    unsigned long (*now)(void *ctx);
+    // readable when poll() has something to return, -1 if there is none
+    int (*fd)(void *ctx);
+    void (*free)(void *ctx);
+    // for application probes, may be NULL without cfg.probe: wait for slot
+    // to become readable (read set) instead of connected, and move data
+    // like send(2)/recv(2) without blocking
+    int (*watch)(void *ctx, unsigned int slot, int read);
+    ssize_t (*send)(void *ctx, unsigned int slot, const void *buf, size_t len);
+    ssize_t (*recv)(void *ctx, unsigned int slot, void *buf, size_t len);
+};
+
+void cscan_config_init(struct cscan_config *cfg);
+cscan_t *cscan_new(const struct cscan_config *cfg);
+void cscan_free(cscan_t *s);
+const char *cscan_error(cscan_t *s);
+
+/*
+ * Targets are scanned in the order they were added, all of them sharing
+ * the cfg.sockets budget. cscan_add_job() tags a target with a job number
+ * that is passed back with its results, and the job callback runs once
+ * every probe of the target has its final outcome. Targets may be added
+ * at any time. Parsing helpers accept "ip[/n]" and "port[-port]".
+ */
+int cscan_parse_hosts(const char *hosts, uint32_t *first, uint32_t *last);
+int cscan_parse_ports(const char *ports, unsigned int *first,
+                      unsigned int *last);
+int cscan_add_target(cscan_t *s, uint32_t first_ip, uint32_t last_ip,
+                     unsigned int first_port, unsigned int last_port);
+int cscan_add_job(cscan_t *s, unsigned long job, uint32_t first_ip,
+                  uint32_t last_ip, unsigned int first_port,
+                  unsigned int last_port);
+int cscan_add_sources(cscan_t *s, const char *list);
+void cscan_set_callback(cscan_t *s, cscan_result_cb cb, void *arg);
+void cscan_set_job_callback(cscan_t *s, cscan_job_cb cb, void *arg);
+
+/*
+ * Replace the transport, only before the first cscan_step(). The context
+ * takes ownership of ctx and releases it with t->free().
+ */
+int cscan_set_transport(cscan_t *s, const struct cscan_transport *t,
+                        void *ctx);
+
+/*
+ * Collect finished probes and start new ones. Returns 1 while there are
+ * probes left to start, 0 once everything was handed out (probes may
+ * still be in flight, keep calling until stats.inflight drops to 0) and
+ * -1 if a socket could not be created; the probe is kept and started on
+ * a later call.
+ */
+int cscan_step(cscan_t *s);
+/*
+ * Milliseconds until the next probe times out or a retry is due, so a
+ * caller can sleep exactly that long when cscan_fd() stays quiet; -1 when
+ * nothing is waiting on the clock.
+ */
+long cscan_next_timeout(cscan_t *s);
+
+/*
+ * Change limits of a running scan. These only store the new value, the
+ * scanner applies it on its next step, so they are safe to call from any
+ * thread and never wait on the scanner. A lower socket count takes effect
+ * as probes above it finish; a paused scanner still collects and times
+ * out probes in flight but starts none. Targets can be appended with
+ * cscan_add_target() from the scanner's own thread.
+ */
+void cscan_set_rate(cscan_t *s, unsigned int rate);
+int cscan_set_sockets(cscan_t *s, unsigned int sockets);
+void cscan_pause(cscan_t *s, int pause);
+int cscan_fd(cscan_t *s);
+void cscan_finish(cscan_t *s);
+void cscan_get_stats(cscan_t *s, struct cscan_stats *st);
+const char *cscan_outcome_name(int outcome);
+
+/*
+ * Simulated network (libcscan-sim.c). Every ip:port has a fixed open,
+ * closed or filtered fate from a hash of the seed, open and closed ports
+ * answer after a per host RTT and filtered ones never do. Time only moves
+ * with cscan_sim_advance(), so a run is fully deterministic:
+ *
+ *     sim = cscan_sim_new(&sim_cfg);
+ *     cscan_set_transport(s, cscan_sim_transport(), sim);
+ *     while (cscan_step(s) || cscan_sim_busy(sim)) cscan_sim_advance(sim, 10);
+ */
+typedef struct cscan_sim cscan_sim_t;
+
+struct cscan_sim_config {
+    uint64_t seed;
+    unsigned int open;             // open ports per 10000
+    unsigned int closed;           // closed ports per 10000, rest filtered
+    unsigned int rtt_min, rtt_max; // ms, fixed per host
+};
+
+void cscan_sim_config_init(struct cscan_sim_config *cfg);
+cscan_sim_t *cscan_sim_new(const struct cscan_sim_config *cfg);
+const struct cscan_transport *cscan_sim_transport(void);
+// the outcome the simulator gives ip:port, CSCAN_OPEN/CLOSED/FILTERED
+int cscan_sim_fate(cscan_sim_t *sim, uint32_t ip, unsigned int port);
+// move the clock to the next reply, but by max_ms at most
+void cscan_sim_advance(cscan_sim_t *sim, unsigned long max_ms);
+// connections still open in the simulator
+unsigned int cscan_sim_busy(cscan_sim_t *sim);
+
+/*
+ * Replayed network (libcscan-replay.c). A pcap of an earlier scan, e.g.
+ * from cscan --pcap, answers every probe as it was answered then: a SYN-ACK
+ * connects, a RST refuses, an ICMP unreachable is unreachable and no answer
+ * times out, all at once. What a service sent is handed to the application
+ * probes, so everything from the completion on can be rerun and timed
+ * without a network:
+ *
+ *     rp = cscan_replay_new("scan.pcap");
+ *     cscan_set_transport(s, cscan_replay_transport(), rp);
+ *
+ * Reads Ethernet, raw IP and Linux cooked captures of IPv4; NULL with
+ * errno set if the file cannot be read (EINVAL if it is not such a pcap).
+ */
+typedef struct cscan_replay cscan_replay_t;
+
+struct cscan_replay_stats {
+    unsigned long packets; // in the capture
+    unsigned long skipped; // not IPv4 TCP or ICMP, or cut short
+    unsigned long probes;  // ip:port a SYN went to
+    unsigned long answers; // packets the probed hosts sent back
+    unsigned long bytes;   // payload of those, in order
+    uint32_t first_ip, last_ip; // range of the probes
+    unsigned int first_port, last_port;
+};
+
+cscan_replay_t *cscan_replay_new(const char *path);
+const struct cscan_transport *cscan_replay_transport(void);
+void cscan_replay_get_stats(cscan_replay_t *rp, struct cscan_replay_stats *st);
+
+// splitmix64 finalizer, the hash shared by the engine, its transports and
+// the tools around it
+static inline uint64_t cscan_mix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+#endif
@@ -0,0 +1,484 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2008 Alexandru Dreptu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Transport for libcscan that answers from a pcap of an earlier scan, see
+ * cscan.h.
+ * Compiling: gcc -Wall -std=gnu11 -c libcscan-replay.c
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cscan.h"
+
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_LINUX_SLL2 276
+
+// room for a live and a stale completion per slot
+#define QUEUE_SIZE (CSCAN_MAX_SOCKS * 2)
+
+#define TH_SYN 0x02
+#define TH_RST 0x04
+#define TH_ACK 0x10
+
+// a probed ip:port and what came back from it
+struct endpoint {
+    uint64_t key; // ip << 16 | port, 0 = free
+    int err;      // what the connect gets, as SO_ERROR would report it
+    int synack;   // seq is known, payload is taken in order from there
+    uint32_t seq; // next byte the service sends
+    size_t off, len; // its payload in data
+};
+
+// service payload in capture order, copied to data once all is read
+struct segment {
+    uint64_t key; // the table may grow, so no pointer
+    const unsigned char *buf;
+    size_t len;
+};
+
+struct cscan_replay {
+    struct cscan_replay_stats st;
+    struct endpoint *eps;
+    unsigned long eps_max; // a power of 2, kept at most half full
+    unsigned char *data;
+    int efd;
+    // per slot: the endpoint, how much of its payload was read, generation
+    struct endpoint *slot_ep[CSCAN_MAX_SOCKS];
+    size_t slot_pos[CSCAN_MAX_SOCKS];
+    unsigned int gen[CSCAN_MAX_SOCKS], queued[CSCAN_MAX_SOCKS];
+    unsigned char open[CSCAN_MAX_SOCKS];
+    // completions in order, one per slot and generation
+    struct {
+        unsigned int slot, gen;
+        int err;
+    } queue[QUEUE_SIZE];
+    unsigned int head, tail;
+};
+
+// reserved endpoint for ip:port that never appear in the capture
+static struct endpoint no_answer = {0, ETIMEDOUT};
+
+static struct endpoint *ep_find(cscan_replay_t *rp, uint64_t key) {
+    unsigned long i = cscan_mix64(key) & (rp->eps_max - 1);
+
+    while (rp->eps[i].key && (rp->eps[i].key != key))
+        i = (i + 1) & (rp->eps_max - 1);
+    return &rp->eps[i];
+}
+
+// the endpoint of key, a new one if add is set; NULL if none or no memory
+static struct endpoint *ep_get(cscan_replay_t *rp, uint64_t key, int add) {
+    struct endpoint *old = rp->eps, *ep;
+    unsigned long i, old_max = rp->eps_max;
+
+    ep = ep_find(rp, key);
+    if (ep->key || !add) return ep->key ? ep : NULL;
+    if (rp->st.probes * 2 >= rp->eps_max) {
+        rp->eps_max *= 2;
+        if (!(rp->eps = calloc(rp->eps_max, sizeof(*rp->eps)))) {
+            rp->eps = old;
+            rp->eps_max = old_max;
+            return NULL;
+        }
+        for (i = 0; i < old_max; i++)
+            if (old[i].key) *ep_find(rp, old[i].key) = old[i];
+        free(old);
+        ep = ep_find(rp, key);
+    }
+    ep->key = key;
+    ep->err = ETIMEDOUT;
+    rp->st.probes++;
+    return ep;
+}
+
+static uint32_t get32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static unsigned int get16(const unsigned char *p) { return p[0] << 8 | p[1]; }
+
+// an ICMP unreachable about one of our SYNs
+static void parse_icmp(cscan_replay_t *rp, const unsigned char *p, size_t len) {
+    struct endpoint *ep;
+    size_t ihl;
+
+    if ((len < 8 + 20) || (p[0] != 3)) return;
+    ihl = (p[8] & 0x0f) * 4;
+    if ((p[8 + 9] != 6) || (len < 8 + ihl + 4)) return;
+    ep = ep_get(rp, (uint64_t)get32(p + 8 + 16) << 16 | get16(p + 8 + ihl + 2),
+                0);
+    if (!ep || !ep->err || (ep->err == ECONNREFUSED)) return;
+    ep->err = p[1] ? EHOSTUNREACH : ENETUNREACH;
+    rp->st.answers++;
+}
+
+static int parse_tcp(cscan_replay_t *rp, uint32_t src, uint32_t dst,
+                     const unsigned char *p, size_t len, struct segment **segs,
+                     unsigned long *segs_nr, unsigned long *segs_max) {
+    struct endpoint *ep;
+    unsigned int flags;
+    size_t off;
+    uint32_t seq;
+
+    if (len < 20) return 0;
+    flags = p[13];
+    off = (p[12] >> 4) * 4;
+    if ((off < 20) || (off > len)) return 0;
+    // a probe: SYN without ACK
+    if ((flags & (TH_SYN | TH_ACK)) == TH_SYN)
+        return ep_get(rp, (uint64_t)dst << 16 | get16(p + 2), 1) ? 1 : -1;
+    // else only what the probed side sends
+    if (!(ep = ep_get(rp, (uint64_t)src << 16 | get16(p), 0))) return 1;
+    rp->st.answers++;
+    seq = get32(p + 4);
+    if ((flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK)) {
+        ep->err = 0;
+        ep->synack = 1;
+        ep->seq = seq + 1;
+        return 1;
+    }
+    if ((flags & TH_RST) && ep->err) {
+        ep->err = ECONNREFUSED;
+        return 1;
+    }
+    if ((len == off) || ep->err) return 1;
+    // retransmissions and overlaps are dropped, a gap is taken as is
+    if (ep->synack) {
+        if ((int32_t)(seq + (len - off) - ep->seq) <= 0) return 1;
+        if ((int32_t)(seq - ep->seq) < 0) {
+            off += ep->seq - seq;
+            seq = ep->seq;
+        }
+        ep->seq = seq + (len - off);
+    }
+    if (*segs_nr == *segs_max) {
+        *segs_max = *segs_max ? *segs_max * 2 : 4096;
+        if (!(*segs = realloc(*segs, *segs_max * sizeof(**segs)))) return -1;
+    }
+    (*segs)[*segs_nr].key = ep->key;
+    (*segs)[*segs_nr].buf = p + off;
+    (*segs)[(*segs_nr)++].len = len - off;
+    ep->len += len - off;
+    rp->st.bytes += len - off;
+    return 1;
+}
+
+// one captured frame; 0 if it was not for us, -1 out of memory
+static int parse_frame(cscan_replay_t *rp, uint32_t link,
+                       const unsigned char *p, size_t len,
+                       struct segment **segs, unsigned long *segs_nr,
+                       unsigned long *segs_max) {
+    unsigned int proto = 0x0800;
+    size_t ihl, tot;
+
+    switch (link) {
+    case LINKTYPE_ETHERNET:
+        if (len < 14) return 0;
+        proto = get16(p + 12);
+        p += 14;
+        len -= 14;
+        if ((proto == 0x8100) && (len >= 4)) {
+            proto = get16(p + 2);
+            p += 4;
+            len -= 4;
+        }
+        break;
+    case LINKTYPE_LINUX_SLL:
+        if (len < 16) return 0;
+        proto = get16(p + 14);
+        p += 16;
+        len -= 16;
+        break;
+    case LINKTYPE_LINUX_SLL2:
+        if (len < 20) return 0;
+        proto = get16(p);
+        p += 20;
+        len -= 20;
+        break;
+    }
+    if ((proto != 0x0800) || (len < 20) || ((p[0] >> 4) != 4)) return 0;
+    ihl = (p[0] & 0x0f) * 4;
+    tot = get16(p + 2);
+    if ((ihl < 20) || (tot < ihl) || (len < ihl)) return 0;
+    // the capture may pad the frame or cut it short
+    if (len > tot) len = tot;
+    // fragments other than the first hold no header
+    if (get16(p + 6) & 0x1fff) return 0;
+    if (p[9] == 6)
+        return parse_tcp(rp, get32(p + 12), get32(p + 16), p + ihl, len - ihl,
+                         segs, segs_nr, segs_max);
+    if (p[9] == 1) {
+        parse_icmp(rp, p + ihl, len - ihl);
+        return 1;
+    }
+    return 0;
+}
+
+// read the whole capture into endpoints and their payload
+static int load(cscan_replay_t *rp, const unsigned char *map, size_t size) {
+    struct segment *segs = NULL;
+    unsigned long segs_nr = 0, segs_max = 0, i;
+    struct endpoint *ep;
+    uint32_t magic, link, incl;
+    size_t pos, total = 0;
+    int swap, ret;
+
+    if (size < 24) goto bad;
+    memcpy(&magic, map, 4);
+    if ((magic == 0xa1b2c3d4) || (magic == 0xa1b23c4d))
+        swap = 0;
+    else if ((magic == 0xd4c3b2a1) || (magic == 0x4d3cb2a1))
+        swap = 1;
+    else
+        goto bad;
+    memcpy(&link, map + 20, 4);
+    if (swap) link = __builtin_bswap32(link);
+    link &= 0xffff;
+    if ((link != LINKTYPE_ETHERNET) && (link != LINKTYPE_RAW) &&
+        (link != LINKTYPE_LINUX_SLL) && (link != LINKTYPE_IPV4) &&
+        (link != LINKTYPE_LINUX_SLL2))
+        goto bad;
+
+    for (pos = 24; pos + 16 <= size; pos += 16 + incl) {
+        memcpy(&incl, map + pos + 8, 4);
+        if (swap) incl = __builtin_bswap32(incl);
+        if (incl > size - pos - 16) break; // cut off at the end
+        rp->st.packets++;
+        ret = parse_frame(rp, link, map + pos + 16, incl, &segs, &segs_nr,
+                          &segs_max);
+        if (ret == -1) {
+            free(segs);
+            return -1;
+        }
+        if (!ret) rp->st.skipped++;
+    }
+
+    // lay every endpoint's payload out in one piece
+    for (i = 0; i < rp->eps_max; i++) {
+        ep = &rp->eps[i];
+        if (!ep->key) continue;
+        ep->off = total;
+        total += ep->len;
+        ep->len = 0;
+        if (!rp->st.first_ip || (ep->key >> 16 < rp->st.first_ip))
+            rp->st.first_ip = ep->key >> 16;
+        if (ep->key >> 16 > rp->st.last_ip) rp->st.last_ip = ep->key >> 16;
+        if (!rp->st.first_port || ((ep->key & 0xffff) < rp->st.first_port))
+            rp->st.first_port = ep->key & 0xffff;
+        if ((ep->key & 0xffff) > rp->st.last_port)
+            rp->st.last_port = ep->key & 0xffff;
+    }
+    if (total && !(rp->data = malloc(total))) {
+        free(segs);
+        return -1;
+    }
+    for (i = 0; i < segs_nr; i++) {
+        ep = ep_find(rp, segs[i].key);
+        memcpy(rp->data + ep->off + ep->len, segs[i].buf, segs[i].len);
+        ep->len += segs[i].len;
+    }
+    free(segs);
+    return 0;
+
+bad:
+    errno = EINVAL;
+    return -1;
+}
+
+static void replay_free(void *ctx) {
+    cscan_replay_t *rp = ctx;
+
+    if (rp->efd != -1) close(rp->efd);
+    free(rp->eps);
+    free(rp->data);
+    free(rp);
+}
+
+cscan_replay_t *cscan_replay_new(const char *path) {
+    cscan_replay_t *rp;
+    struct stat sb;
+    void *map;
+    int fd, ret, err;
+
+    if ((fd = open(path, O_RDONLY)) == -1) return NULL;
+    if (fstat(fd, &sb) == -1) {
+        close(fd);
+        return NULL;
+    }
+    map = sb.st_size ? mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                     : MAP_FAILED;
+    err = sb.st_size ? errno : EINVAL;
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = err;
+        return NULL;
+    }
+    madvise(map, sb.st_size, MADV_SEQUENTIAL);
+
+    if (!(rp = calloc(1, sizeof(*rp)))) goto fail;
+    rp->efd = -1;
+    rp->eps_max = 65536;
+    if (!(rp->eps = calloc(rp->eps_max, sizeof(*rp->eps)))) goto fail;
+    ret = load(rp, map, sb.st_size);
+    err = errno;
+    munmap(map, sb.st_size);
+    map = MAP_FAILED;
+    if (ret == -1) {
+        errno = err;
+        goto fail;
+    }
+    if ((rp->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) goto fail;
+    return rp;
+
+fail:
+    err = errno;
+    if (map != MAP_FAILED) munmap(map, sb.st_size);
+    if (rp) replay_free(rp);
+    errno = err;
+    return NULL;
+}
+
+void cscan_replay_get_stats(cscan_replay_t *rp, struct cscan_replay_stats *st) {
+    *st = rp->st;
+}
+
+// slot is ready, once: keeps the eventfd readable while anything is queued
+static void push(cscan_replay_t *rp, unsigned int slot, int err) {
+    uint64_t one = 1;
+    unsigned int i;
+
+    if ((rp->queued[slot] == rp->gen[slot]) ||
+        (rp->tail - rp->head == QUEUE_SIZE))
+        return;
+    rp->queued[slot] = rp->gen[slot];
+    if (rp->head == rp->tail) write(rp->efd, &one, sizeof(one));
+    i = rp->tail++ % QUEUE_SIZE;
+    rp->queue[i].slot = slot;
+    rp->queue[i].gen = rp->gen[slot];
+    rp->queue[i].err = err;
+}
+
+static int replay_connect(void *ctx, unsigned int slot, uint32_t ip,
+                          unsigned int port, uint32_t src) {
+    cscan_replay_t *rp = ctx;
+    struct endpoint *ep;
+
+    if ((slot >= CSCAN_MAX_SOCKS) || rp->open[slot]) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (!(ep = ep_get(rp, (uint64_t)ip << 16 | port, 0))) ep = &no_answer;
+    rp->open[slot] = 1;
+    rp->gen[slot]++;
+    rp->slot_ep[slot] = ep;
+    rp->slot_pos[slot] = 0;
+    // answers come at once, a probe that got none times out at once too
+    push(rp, slot, ep->err);
+    return 0;
+}
+
+static int replay_poll(void *ctx, struct cscan_completion *done, int max) {
+    cscan_replay_t *rp = ctx;
+    uint64_t val;
+    unsigned int i;
+    int nr = 0;
+
+    while ((nr < max) && (rp->head != rp->tail)) {
+        i = rp->head++ % QUEUE_SIZE;
+        if (!rp->open[rp->queue[i].slot] ||
+            (rp->gen[rp->queue[i].slot] != rp->queue[i].gen))
+            continue;
+        rp->queued[rp->queue[i].slot] = 0;
+        done[nr].slot = rp->queue[i].slot;
+        done[nr++].err = rp->queue[i].err;
+    }
+    if (rp->head == rp->tail) read(rp->efd, &val, sizeof(val));
+    return nr;
+}
+
+static void replay_close(void *ctx, unsigned int slot, int rst) {
+    cscan_replay_t *rp = ctx;
+
+    if (slot < CSCAN_MAX_SOCKS) rp->open[slot] = 0;
+}
+
+static unsigned long replay_now(void *ctx) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+static int replay_fd(void *ctx) { return ((cscan_replay_t *)ctx)->efd; }
+
+// everything the service sent is there already, so reads never wait
+static int replay_watch(void *ctx, unsigned int slot, int read) {
+    cscan_replay_t *rp = ctx;
+
+    if ((slot >= CSCAN_MAX_SOCKS) || !rp->open[slot]) {
+        errno = EBADF;
+        return -1;
+    }
+    push(rp, slot, 0);
+    return 0;
+}
+
+static ssize_t replay_send(void *ctx, unsigned int slot, const void *buf,
+                           size_t len) {
+    return len;
+}
+
+// the recorded payload, then EOF; the slot stays readable until then
+static ssize_t replay_recv(void *ctx, unsigned int slot, void *buf,
+                           size_t len) {
+    cscan_replay_t *rp = ctx;
+    struct endpoint *ep = rp->slot_ep[slot];
+
+    if (len > ep->len - rp->slot_pos[slot])
+        len = ep->len - rp->slot_pos[slot];
+    memcpy(buf, rp->data + ep->off + rp->slot_pos[slot], len);
+    rp->slot_pos[slot] += len;
+    push(rp, slot, 0);
+    return len;
+}
+
+static const struct cscan_transport replay_ops = {
+    replay_connect, replay_poll,  replay_close, replay_now, replay_fd,
+    replay_free,    replay_watch, replay_send,  replay_recv};
+
+const struct cscan_transport *cscan_replay_transport(void) {
+    return &replay_ops;
+}
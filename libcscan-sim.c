@@ -0,0 +1,237 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2008 Alexandru Dreptu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * In-memory transport for libcscan on a virtual clock, see cscan.h.
+ * Compiling: gcc -Wall -std=gnu11 -c libcscan-sim.c
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cscan.h"
+
+// a pending reply, ordered by due time in a binary heap
+struct event {
+    unsigned long due;
+    unsigned int slot;
+    unsigned int gen;
+};
+
+struct cscan_sim {
+    struct cscan_sim_config cfg;
+    unsigned long now;
+    unsigned int busy;
+    // per slot: generation of the current connection and its reply
+    unsigned int gen[CSCAN_MAX_SOCKS];
+    unsigned char open[CSCAN_MAX_SOCKS];
+    int err[CSCAN_MAX_SOCKS];
+    // at most one live event per slot, stale ones are skipped when popped
+    struct event heap[CSCAN_MAX_SOCKS * 2];
+    unsigned int heap_nr;
+};
+
+static void heap_push(cscan_sim_t *sim, struct event *ev) {
+    unsigned int i = sim->heap_nr++, up;
+
+    while (i) {
+        up = (i - 1) / 2;
+        if (sim->heap[up].due <= ev->due) break;
+        sim->heap[i] = sim->heap[up];
+        i = up;
+    }
+    sim->heap[i] = *ev;
+}
+
+static void heap_pop(cscan_sim_t *sim) {
+    struct event last = sim->heap[--sim->heap_nr];
+    unsigned int i = 0, c;
+
+    for (;;) {
+        c = i * 2 + 1;
+        if (c >= sim->heap_nr) break;
+        if ((c + 1 < sim->heap_nr) && (sim->heap[c + 1].due < sim->heap[c].due))
+            c++;
+        if (last.due <= sim->heap[c].due) break;
+        sim->heap[i] = sim->heap[c];
+        i = c;
+    }
+    sim->heap[i] = last;
+}
+
+// drop events of connections that were closed in the meantime
+static void heap_trim(cscan_sim_t *sim) {
+    struct event *ev;
+
+    while (sim->heap_nr) {
+        ev = &sim->heap[0];
+        if (sim->open[ev->slot] && (sim->gen[ev->slot] == ev->gen)) break;
+        heap_pop(sim);
+    }
+}
+
+// rebuild the heap from live events only, makes room when it fills up
+static void heap_compact(cscan_sim_t *sim) {
+    struct event evs[CSCAN_MAX_SOCKS * 2];
+    unsigned int i, n = 0;
+
+    for (i = 0; i < sim->heap_nr; i++)
+        if (sim->open[sim->heap[i].slot] &&
+            (sim->gen[sim->heap[i].slot] == sim->heap[i].gen))
+            evs[n++] = sim->heap[i];
+    sim->heap_nr = 0;
+    for (i = 0; i < n; i++) heap_push(sim, &evs[i]);
+}
+
+void cscan_sim_config_init(struct cscan_sim_config *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->open = 500;
+    cfg->closed = 4500;
+    cfg->rtt_min = 20;
+    cfg->rtt_max = 200;
+}
+
+cscan_sim_t *cscan_sim_new(const struct cscan_sim_config *cfg) {
+    cscan_sim_t *sim;
+
+    if ((cfg->open + cfg->closed > 10000) || (cfg->rtt_min > cfg->rtt_max)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!(sim = calloc(1, sizeof(*sim)))) return NULL;
+    sim->cfg = *cfg;
+    // start away from 0, the engine uses 0 for "not set"
+    sim->now = 1000;
+    return sim;
+}
+
+int cscan_sim_fate(cscan_sim_t *sim, uint32_t ip, unsigned int port) {
+    unsigned int r = cscan_mix64(sim->cfg.seed ^ ((uint64_t)ip << 16) ^ port) % 10000;
+
+    if (r < sim->cfg.open) return CSCAN_OPEN;
+    if (r < sim->cfg.open + sim->cfg.closed) return CSCAN_CLOSED;
+    return CSCAN_FILTERED;
+}
+
+void cscan_sim_advance(cscan_sim_t *sim, unsigned long max_ms) {
+    heap_trim(sim);
+    if (sim->heap_nr && (sim->heap[0].due <= sim->now)) return;
+    if (sim->heap_nr && (sim->heap[0].due - sim->now < max_ms))
+        sim->now = sim->heap[0].due;
+    else
+        sim->now += max_ms;
+}
+
+unsigned int cscan_sim_busy(cscan_sim_t *sim) { return sim->busy; }
+
+static int sim_connect(void *ctx, unsigned int slot, uint32_t ip,
+                       unsigned int port, uint32_t src) {
+    cscan_sim_t *sim = ctx;
+    struct event ev;
+    unsigned int rtt = sim->cfg.rtt_min;
+
+    if ((slot >= CSCAN_MAX_SOCKS) || sim->open[slot]) {
+        errno = EBUSY;
+        return -1;
+    }
+    sim->open[slot] = 1;
+    sim->gen[slot]++;
+    sim->busy++;
+    switch (cscan_sim_fate(sim, ip, port)) {
+    case CSCAN_OPEN: sim->err[slot] = 0; break;
+    case CSCAN_CLOSED: sim->err[slot] = ECONNREFUSED; break;
+    default: return 0; // no reply, left to the engine's timeout
+    }
+    if (sim->cfg.rtt_max > sim->cfg.rtt_min)
+        rtt += cscan_mix64(sim->cfg.seed ^ 0xc2b2ae35ULL ^ ip) %
+               (sim->cfg.rtt_max - sim->cfg.rtt_min + 1);
+    ev.due = sim->now + rtt;
+    ev.slot = slot;
+    ev.gen = sim->gen[slot];
+    if (sim->heap_nr == CSCAN_MAX_SOCKS * 2) heap_compact(sim);
+    heap_push(sim, &ev);
+    return 0;
+}
+
+static int sim_poll(void *ctx, struct cscan_completion *done, int max) {
+    cscan_sim_t *sim = ctx;
+    int nr = 0;
+
+    while (nr < max) {
+        heap_trim(sim);
+        if (!sim->heap_nr || (sim->heap[0].due > sim->now)) break;
+        done[nr].slot = sim->heap[0].slot;
+        done[nr++].err = sim->err[sim->heap[0].slot];
+        heap_pop(sim);
+    }
+    return nr;
+}
+
+static void sim_close(void *ctx, unsigned int slot, int rst) {
+    cscan_sim_t *sim = ctx;
+
+    if ((slot >= CSCAN_MAX_SOCKS) || !sim->open[slot]) return;
+    sim->open[slot] = 0;
+    sim->busy--;
+}
+
+static unsigned long sim_now(void *ctx) { return ((cscan_sim_t *)ctx)->now; }
+
+static int sim_fd(void *ctx) { return -1; }
+
+static void sim_free(void *ctx) { free(ctx); }
+
+// simulated services accept and hang up at once: reads see EOF right away
+static int sim_watch(void *ctx, unsigned int slot, int read) {
+    cscan_sim_t *sim = ctx;
+    struct event ev;
+
+    if ((slot >= CSCAN_MAX_SOCKS) || !sim->open[slot]) {
+        errno = EBADF;
+        return -1;
+    }
+    sim->err[slot] = 0;
+    ev.due = sim->now;
+    ev.slot = slot;
+    ev.gen = ++sim->gen[slot];
+    if (sim->heap_nr == CSCAN_MAX_SOCKS * 2) heap_compact(sim);
+    heap_push(sim, &ev);
+    return 0;
+}
+
+static ssize_t sim_send(void *ctx, unsigned int slot, const void *buf,
+                        size_t len) {
+    return len;
+}
+
+static ssize_t sim_recv(void *ctx, unsigned int slot, void *buf, size_t len) {
+    return 0;
+}
+
+static const struct cscan_transport sim_ops = {
+    sim_connect, sim_poll, sim_close, sim_now,
+    sim_fd,      sim_free, sim_watch, sim_send, sim_recv};
+
+const struct cscan_transport *cscan_sim_transport(void) { return &sim_ops; }
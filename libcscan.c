@@ -0,0 +1,1646 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2008 Alexandru Dreptu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * TCP connect scanning engine using non-blocking sockets, see cscan.h.
+ * Compiling: gcc -Wall -std=gnu11 -c libcscan.c
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cscan.h"
+
+#define STATUS_NONE 1
+#define STATUS_CONNECTING 2
+#define STATUS_TALKING 3 // open, an application probe is running
+
+// per-host tracking table (open addressing, power of two)
+#define HOST_TABLE_SIZE (CSCAN_MAX_SOCKS * 4)
+#define HOST_USED 1
+#define HOST_ALIVE 2
+#define HOST_DEAD 4
+#define HOST_ACTIVE 8
+
+// retransmission of timed out probes, one queue per attempt number
+#define RETRY_QUEUE_SIZE (CSCAN_MAX_SOCKS * 4)
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+// seconds between TIME_WAIT / port usage samples
+#define STATS_INTERVAL 5
+
+// completions collected per epoll_wait()
+#define EVENTS_NR 256
+
+// with kernel timeouts, how long after the kernel's deadline we step in
+#define KTIMEOUT_GRACE 1000
+
+// rate limiter credit per probe, and the burst it may build up (in ms)
+#define RATE_UNIT 1000
+#define RATE_BURST 100
+
+// cold per slot state, only touched when the slot's probe starts or ends
+struct connection {
+    unsigned int target;
+    unsigned int tries;
+    uint32_t ip;
+    unsigned int port;
+    unsigned long sent_us; // when connect() was called
+    unsigned long rtt_us;  // until the answer, once there is one
+};
+
+struct probe {
+    uint32_t ip;
+    unsigned int port;
+    unsigned int target;
+    unsigned int tries;
+    unsigned long due; // ms
+};
+
+struct retry_queue {
+    struct probe q[RETRY_QUEUE_SIZE];
+    unsigned int head, len;
+};
+
+/*
+ * State of an application probe on an open port. Probes are stackless
+ * coroutines: a probe function runs until it has to wait for data, saves
+ * the line to resume at and returns; the next event on its slot calls it
+ * again and the switch in CO_BEGIN jumps back there. Locals do not survive
+ * a wait, whatever must is kept here.
+ */
+#define CO_BUF_SIZE 256
+#define CO_INFO_SIZE 128
+#define CO_PATH_SIZE 128 // longest redirect path that is followed
+
+struct coro {
+    unsigned short line; // where to resume, 0 = start
+    unsigned short len;  // bytes in buf
+    unsigned int skip;   // body bytes still to discard
+    unsigned char flags, has_len;
+    char buf[CO_BUF_SIZE];
+    char info[CO_INFO_SIZE];
+    char path[CO_PATH_SIZE]; // of the redirect followed
+};
+
+/*
+ * Memory of a context. Everything sized by the config is carved out of one
+ * anonymous mapping at cscan_new(), so probes and hosts never allocate and
+ * the whole working set can be backed by huge pages.
+ */
+#define ARENA_ALIGN 64
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+struct arena {
+    char *base;
+    size_t size, used;
+    int huge; // CSCAN_HUGE_*
+};
+
+struct host {
+    uint32_t ip;
+    uint16_t flags;
+    uint16_t timeouts;
+    uint16_t inflight;
+    uint16_t pending; // queued retries
+};
+
+struct host_table {
+    struct host e[HOST_TABLE_SIZE];
+    unsigned int used;
+};
+
+// a host the generator is currently handing out ports for
+struct cursor {
+    uint32_t ip;
+    unsigned long port;
+};
+
+struct target {
+    uint32_t first_ip, last_ip;
+    unsigned int first_port, last_port;
+    unsigned long job;
+    uint64_t left; // probes without a final outcome yet
+};
+
+struct cscan {
+    struct arena arena; // the context itself lives in it
+    struct cscan_config cfg;
+    struct cscan_stats st;
+    /*
+     * Slots. What every step looks at is kept apart from conns: the status
+     * and deadline arrays, a dense list of the busy slots for the timeout
+     * sweep and a stack of free ones below cfg.sockets for refilling.
+     */
+    unsigned char status[CSCAN_MAX_SOCKS];
+    unsigned long due[CSCAN_MAX_SOCKS]; // ms when the probe times out
+    unsigned long next_due;             // no slot is due before this
+    unsigned long collect_us;           // when the last completions came
+    int ktimeout;                       // the kernel times out connects
+    uint16_t active[CSCAN_MAX_SOCKS], active_pos[CSCAN_MAX_SOCKS];
+    uint16_t free_slots[CSCAN_MAX_SOCKS];
+    unsigned int free_nr;
+    struct connection conns[CSCAN_MAX_SOCKS];
+    struct coro *coros; // per slot, only with cfg.probe
+    struct host_table hosts, nets;
+    uint64_t **alive; // hosts that answered, a bitmap per /16, see host_release()
+    struct cursor cursors[CSCAN_MAX_SOCKS];
+    unsigned int cursors_nr, cursor_rr;
+    struct retry_queue retries[CSCAN_MAX_RETRIES];
+
+    // targets, the generator works on targets[target_cur]
+    struct target *targets;
+    unsigned int targets_nr, targets_max, target_cur;
+    int target_open;
+    unsigned long feed_base, feed_idx, feed_nr, feed_blocks;
+    unsigned long start_port, end_port;
+    struct probe held, stream;
+    int has_held, has_stream, gen_done, paused;
+    uint64_t index_nr, stream_pos, stream_nr;
+    uint64_t perm_keys[4];
+    int perm_half;
+
+    uint32_t sources[CSCAN_MAX_SOURCES];
+    unsigned int sources_nr, source_rr;
+
+    const struct cscan_transport *tp;
+    void *tp_ctx;
+    unsigned long stats_time;
+
+    // knobs that may change while scanning, see cscan_set_rate()
+    atomic_uint want_rate, want_sockets;
+    atomic_int want_pause;
+    unsigned long rate_credit, rate_time;
+    cscan_result_cb cb;
+    void *cb_arg;
+    cscan_job_cb job_cb;
+    void *job_arg;
+    char err[256];
+};
+
+static const char *outcome_names[CSCAN_OUTCOME_NR] = {
+    "open", "closed", "filtered", "unreachable", "error"};
+
+// monotonic clock in milliseconds
+static unsigned long now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+// the transport's clock
+static unsigned long clock_ms(cscan_t *s) { return s->tp->now(s->tp_ctx); }
+
+static int set_error(cscan_t *s, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(s->err, sizeof(s->err), fmt, ap);
+    va_end(ap);
+    return -1;
+}
+
+static unsigned int host_slot(uint32_t ip) {
+    return (ip * 2654435761u) & (HOST_TABLE_SIZE - 1);
+}
+
+// find the entry for ip (a host, or a /24 in nets), NULL if not tracked
+static struct host *host_find(struct host_table *tab, uint32_t ip) {
+    unsigned int i = host_slot(ip);
+
+    while (tab->e[i].flags & HOST_USED) {
+        if (tab->e[i].ip == ip) return &tab->e[i];
+        i = (i + 1) & (HOST_TABLE_SIZE - 1);
+    }
+    return NULL;
+}
+
+// find or insert the entry for ip, NULL if the table is 3/4 full
+static struct host *host_get(struct host_table *tab, uint32_t ip) {
+    unsigned int i = host_slot(ip);
+
+    while (tab->e[i].flags & HOST_USED) {
+        if (tab->e[i].ip == ip) return &tab->e[i];
+        i = (i + 1) & (HOST_TABLE_SIZE - 1);
+    }
+    if (tab->used >= HOST_TABLE_SIZE / 4 * 3) return NULL;
+    memset(&tab->e[i], 0, sizeof(struct host));
+    tab->e[i].ip = ip;
+    tab->e[i].flags = HOST_USED;
+    tab->used++;
+    return &tab->e[i];
+}
+
+// remove an entry, shifting back the rest of its probe chain
+static void host_del(struct host_table *tab, struct host *h) {
+    unsigned int i = h - tab->e, j = i, k;
+
+    for (;;) {
+        j = (j + 1) & (HOST_TABLE_SIZE - 1);
+        if (!(tab->e[j].flags & HOST_USED)) break;
+        k = host_slot(tab->e[j].ip);
+        // leave entries whose home slot lies cyclically in (i, j]
+        if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+            continue;
+        tab->e[i] = tab->e[j];
+        i = j;
+    }
+    tab->e[i].flags = 0;
+    tab->used--;
+}
+
+// remember that ip answered, -1 if out of memory
+static int alive_set(cscan_t *s, uint32_t ip) {
+    uint64_t **b;
+
+    if (!s->alive) {
+        if (!(s->alive = calloc(65536, sizeof(*s->alive)))) return -1;
+        s->st.allocs++;
+    }
+    b = &s->alive[ip >> 16];
+    if (!*b) {
+        if (!(*b = calloc(1024, sizeof(**b)))) return -1;
+        s->st.allocs++;
+    }
+    (*b)[(ip & 0xffff) >> 6] |= 1ULL << (ip & 63);
+    return 0;
+}
+
+static int alive_test(cscan_t *s, uint32_t ip) {
+    uint64_t *b;
+
+    if (!s->alive || !(b = s->alive[ip >> 16])) return 0;
+    return (b[(ip & 0xffff) >> 6] >> (ip & 63)) & 1;
+}
+
+/*
+ * Drop a host entry nothing refers to anymore. Entries of hosts that only
+ * timed out so far are kept while the table is at most half full, so the
+ * dead host check still works when a host's ports are spread over the
+ * whole scan (randomized or sharded order). Hosts that answered go to the
+ * alive bitmaps first, so a later entry for them starts out alive and
+ * their timeouts never count against them.
+ */
+static void host_release(cscan_t *s, struct host *h) {
+    if (h->inflight || h->pending || (h->flags & HOST_ACTIVE)) return;
+    if (h->flags & HOST_ALIVE) {
+        if (s->cfg.dead_after && (alive_set(s, h->ip) == -1)) return;
+    } else if (((h->flags & HOST_DEAD) || h->timeouts) &&
+               (s->hosts.used <= HOST_TABLE_SIZE / 2))
+        return;
+    host_del(&s->hosts, h);
+}
+
+// host_get() on the host table, for hosts that answered before too
+static struct host *host_track(cscan_t *s, uint32_t ip) {
+    struct host *h = host_get(&s->hosts, ip);
+
+    if (h && (h->flags == HOST_USED) && alive_test(s, ip))
+        h->flags |= HOST_ALIVE;
+    return h;
+}
+
+// account a started probe against its host and /24
+static void host_start(cscan_t *s, uint32_t ip) {
+    struct host *h;
+
+    if ((h = host_find(&s->hosts, ip))) h->inflight++;
+    if (s->cfg.net_cap && (h = host_get(&s->nets, ip >> 8))) h->inflight++;
+}
+
+// account a resolved probe; answered is set on SYN-ACK or RST
+static void host_done(cscan_t *s, uint32_t ip, int answered) {
+    struct host *h;
+
+    if (s->cfg.net_cap && (h = host_find(&s->nets, ip >> 8))) {
+        if (h->inflight) h->inflight--;
+        if (!h->inflight) host_del(&s->nets, h);
+    }
+
+    if (!(h = host_find(&s->hosts, ip))) return;
+    if (h->inflight) h->inflight--;
+    if (answered) {
+        h->flags |= HOST_ALIVE;
+        h->timeouts = 0;
+    } else if (!(h->flags & (HOST_ALIVE | HOST_DEAD))) {
+        if (h->timeouts < UINT16_MAX) h->timeouts++;
+        if (s->cfg.dead_after && (h->timeouts >= s->cfg.dead_after)) {
+            h->flags |= HOST_DEAD;
+            s->st.dead_hosts++;
+        }
+    }
+    // nothing left to learn about hosts the generator has moved past
+    host_release(s, h);
+}
+
+// drop a cursor once its host is finished or found dead
+static void cursor_del(cscan_t *s, unsigned int i) {
+    struct host *h = host_find(&s->hosts, s->cursors[i].ip);
+
+    if (h) {
+        h->flags &= ~HOST_ACTIVE;
+        host_release(s, h);
+    }
+    s->cursors[i] = s->cursors[--s->cursors_nr];
+}
+
+// check the per-host and per-/24 in-flight caps for ip
+static int host_ready(cscan_t *s, uint32_t ip) {
+    struct host *h;
+
+    if (s->cfg.host_cap && (h = host_find(&s->hosts, ip)) &&
+        (h->inflight >= s->cfg.host_cap))
+        return 0;
+    if (s->cfg.net_cap && (h = host_find(&s->nets, ip >> 8)) &&
+        (h->inflight >= s->cfg.net_cap))
+        return 0;
+    return 1;
+}
+
+// n probes of target t are final, tell the caller once its job is done
+static void target_settle(cscan_t *s, unsigned int t, uint64_t n) {
+    struct target *tg = &s->targets[t];
+
+    tg->left = (tg->left > n) ? tg->left - n : 0;
+    if (!tg->left && s->job_cb) s->job_cb(tg->job, s->job_arg);
+}
+
+// probes of target t skipped because their host is dead
+static void probes_saved(cscan_t *s, unsigned int t, uint64_t n) {
+    s->st.probes_saved += n;
+    target_settle(s, t, n);
+}
+
+// queue a timed out probe again, backing off exponentially per attempt
+static int retry_add(cscan_t *s, uint32_t ip, unsigned int port,
+                     unsigned int target, unsigned int tries) {
+    struct retry_queue *rq = &s->retries[tries - 1];
+    struct probe *p;
+    struct host *h;
+
+    if (rq->len == RETRY_QUEUE_SIZE) {
+        s->st.retries_dropped++;
+        return -1;
+    }
+    p = &rq->q[(rq->head + rq->len++) % RETRY_QUEUE_SIZE];
+    p->ip = ip;
+    p->port = port;
+    p->target = target;
+    p->tries = tries;
+    p->due = clock_ms(s) + ((unsigned long)s->cfg.backoff << (tries - 1));
+    if ((h = host_track(s, ip))) h->pending++;
+    return 0;
+}
+
+// take the first due retry that is not capped, 0 if there is none
+static int retry_next(cscan_t *s, struct probe *p) {
+    struct retry_queue *rq;
+    struct host *h;
+    unsigned long now = 0;
+    unsigned int i;
+
+    for (i = 0; i < s->cfg.retries; i++) {
+        rq = &s->retries[i];
+        while (rq->len) {
+            // each queue is ordered by due time, only its head matters
+            *p = rq->q[rq->head];
+            if (!now) now = clock_ms(s);
+            if (p->due > now) break;
+            h = host_find(&s->hosts, p->ip);
+            if (!h || !(h->flags & HOST_DEAD)) {
+                if (!host_ready(s, p->ip)) break;
+            }
+            rq->head = (rq->head + 1) % RETRY_QUEUE_SIZE;
+            rq->len--;
+            if (h) {
+                h->pending--;
+                if (h->flags & HOST_DEAD) {
+                    probes_saved(s, p->target, 1);
+                    host_release(s, h);
+                    continue;
+                }
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// anything queued for retransmission
+static int retry_pending(cscan_t *s) {
+    unsigned int i;
+
+    for (i = 0; i < s->cfg.retries; i++)
+        if (s->retries[i].len) return 1;
+    return 0;
+}
+
+// next port of the cursor window, see next_probe()
+static int cursor_next(cscan_t *s, struct probe *p) {
+    struct cursor *c;
+    struct host *h;
+    unsigned int i, n = 0;
+    uint32_t ip;
+
+    for (;;) {
+        if (n >= s->cursors_nr) {
+            // every open host is capped, open a new one
+            if ((s->feed_idx >= s->feed_nr) ||
+                (s->cursors_nr >= s->cfg.sockets))
+                return ((s->feed_idx < s->feed_nr) || s->cursors_nr) ? 0 : -1;
+            if (s->feed_blocks) // walk the /24s side by side
+                ip = s->feed_base + (s->feed_idx % s->feed_blocks) * 256 +
+                     s->feed_idx / s->feed_blocks;
+            else
+                ip = s->feed_base + s->feed_idx;
+            if (!(h = host_track(s, ip))) return 0;
+            h->flags |= HOST_ACTIVE;
+            s->feed_idx++;
+            i = s->cursors_nr++;
+            s->cursors[i].ip = ip;
+            s->cursors[i].port = s->start_port;
+        } else
+            i = (s->cursor_rr + n++) % s->cursors_nr;
+        c = &s->cursors[i];
+
+        // skip what is left of hosts found dead
+        h = host_find(&s->hosts, c->ip);
+        if (h && (h->flags & HOST_DEAD)) {
+            probes_saved(s, s->target_cur, s->end_port - c->port + 1);
+            cursor_del(s, i);
+            continue;
+        }
+        if (!host_ready(s, c->ip)) continue;
+
+        p->ip = c->ip;
+        p->port = c->port++;
+        p->target = s->target_cur;
+        p->tries = 0;
+        if (c->port > s->end_port) cursor_del(s, i);
+        s->cursor_rr = i + 1;
+        return 1;
+    }
+}
+
+// set up the keyed permutation of [0, index_nr)
+static void permute_init(cscan_t *s) {
+    int i;
+
+    s->perm_half = 1;
+    while ((1ULL << (s->perm_half * 2)) < s->index_nr) s->perm_half++;
+    for (i = 0; i < 4; i++) s->perm_keys[i] = cscan_mix64(s->cfg.seed + i + 1);
+}
+
+/*
+ * Keyed bijection on [0, index_nr): a 4 round Feistel network over the
+ * next even power of two, cycle walking until the value is in range.
+ * Every node of a shard set computes the same order from the same seed.
+ */
+static uint64_t permute(cscan_t *s, uint64_t x) {
+    uint64_t mask = (1ULL << s->perm_half) - 1, l, r, t;
+    int i;
+
+    do {
+        l = x >> s->perm_half;
+        r = x & mask;
+        for (i = 0; i < 4; i++) {
+            t = l ^ (cscan_mix64(r ^ s->perm_keys[i]) & mask);
+            l = r;
+            r = t;
+        }
+        x = (l << s->perm_half) | r;
+    } while (x >= s->index_nr);
+    return x;
+}
+
+/*
+ * Next probe of this shard's slice of the ip x port index space. Shard i
+ * of N takes positions i, i + N, i + 2N, ... of the (optionally permuted)
+ * order, so any N shards cover the space exactly once between them.
+ */
+static int stream_next(cscan_t *s, struct probe *p) {
+    uint64_t idx, ports = s->end_port - s->start_port + 1;
+    struct host *h;
+
+    for (;;) {
+        if (!s->has_stream) {
+            if (s->stream_pos >= s->stream_nr) return -1;
+            idx = s->cfg.shard_idx + s->stream_pos++ * s->cfg.shard_nr;
+            if (s->cfg.randomize) idx = permute(s, idx);
+            s->stream.ip = s->feed_base + idx / ports;
+            s->stream.port = s->start_port + idx % ports;
+            s->stream.target = s->target_cur;
+            s->stream.tries = 0;
+            s->has_stream = 1;
+        }
+
+        h = host_find(&s->hosts, s->stream.ip);
+        if (h && (h->flags & HOST_DEAD)) {
+            probes_saved(s, s->target_cur, 1);
+            s->has_stream = 0;
+            continue;
+        }
+        // a capped target waits at the head of the stream
+        if (!host_ready(s, s->stream.ip)) return 0;
+        if (!h && (s->cfg.dead_after || s->cfg.host_cap))
+            host_track(s, s->stream.ip);
+
+        *p = s->stream;
+        s->has_stream = 0;
+        return 1;
+    }
+}
+
+// this node's share of a target's probes
+static uint64_t target_share(cscan_t *s, struct target *t) {
+    uint64_t nr = ((uint64_t)t->last_ip - t->first_ip + 1) *
+                  (t->last_port - t->first_port + 1);
+
+    if (nr <= s->cfg.shard_idx) return 0;
+    return (nr - s->cfg.shard_idx + s->cfg.shard_nr - 1) / s->cfg.shard_nr;
+}
+
+// point the generator at targets[target_cur]
+static void target_load(cscan_t *s) {
+    struct target *t = &s->targets[s->target_cur];
+
+    s->feed_base = t->first_ip;
+    s->feed_idx = 0;
+    s->feed_nr = (unsigned long)t->last_ip - t->first_ip + 1;
+    // spread hosts over the /24s when those are capped
+    s->feed_blocks =
+        (s->cfg.net_cap && (s->feed_nr > 256)) ? s->feed_nr / 256 : 0;
+    s->start_port = t->first_port;
+    s->end_port = t->last_port;
+
+    s->index_nr = (uint64_t)s->feed_nr * (s->end_port - s->start_port + 1);
+    s->stream_pos = 0;
+    s->stream_nr = target_share(s, t);
+    if (s->cfg.randomize) permute_init(s);
+    s->target_open = 1;
+}
+
+/*
+ * Pick the next target. Due retries go first, then new work: either from
+ * the shard / randomized index stream, or round-robin from a window of
+ * host cursors, so a host or /24 that reached its cap leaves the slot to
+ * another target. Returns 1 with p set, 0 if every open target is capped
+ * or waiting right now and -1 once all targets were handed out and
+ * nothing can come back for a retry.
+ */
+static int next_probe(cscan_t *s, struct probe *p) {
+    int ret = -1;
+
+    // a probe that could not be started last time goes first
+    if (s->has_held) {
+        *p = s->held;
+        s->has_held = 0;
+        return 1;
+    }
+    if (s->cfg.retries && retry_next(s, p)) return 1;
+
+    while (s->target_cur < s->targets_nr) {
+        if (!s->target_open) target_load(s);
+        ret = ((s->cfg.shard_nr > 1) || s->cfg.randomize) ? stream_next(s, p)
+                                                          : cursor_next(s, p);
+        if (ret != -1) break;
+        s->target_cur++;
+        s->target_open = 0;
+    }
+    if ((ret == -1) && s->cfg.retries &&
+        (s->st.inflight || retry_pending(s)))
+        return 0;
+    return ret;
+}
+
+// hand the final outcome of a probe to the caller
+static void report(cscan_t *s, struct connection *sc, int outcome,
+                   const char *info) {
+    struct cscan_result res;
+
+    s->st.outcomes[outcome]++;
+    if (s->cb) {
+        res.ip = sc->ip;
+        res.port = sc->port;
+        res.outcome = outcome;
+        res.tries = sc->tries;
+        res.job = s->targets[sc->target].job;
+        res.info = info;
+        res.rtt_us = sc->rtt_us;
+        s->cb(&res, s->cb_arg);
+    }
+    target_settle(s, sc->target, 1);
+}
+
+// refill the free stack with the idle slots below cfg.sockets, lowest on top
+static void slots_reset(cscan_t *s) {
+    unsigned int x;
+
+    s->free_nr = 0;
+    for (x = s->cfg.sockets; x--;)
+        if (s->status[x] == STATUS_NONE) s->free_slots[s->free_nr++] = x;
+}
+
+// the slot times out in ms from now
+static void slot_due(cscan_t *s, unsigned int x, unsigned long ms) {
+    s->due[x] = clock_ms(s) + ms;
+    if (s->due[x] < s->next_due) s->next_due = s->due[x];
+}
+
+// a free slot starts a probe
+static void slot_start(cscan_t *s, unsigned int x) {
+    s->status[x] = STATUS_CONNECTING;
+    // the kernel reports a timeout itself, ours is only a backstop
+    slot_due(s, x,
+             s->cfg.timeout * 1000UL + (s->ktimeout ? KTIMEOUT_GRACE : 0));
+    s->active_pos[x] = s->st.inflight;
+    s->active[s->st.inflight++] = x;
+}
+
+// clean connection structure
+static void clean_struct(cscan_t *s, struct connection *sc) {
+    unsigned int x = sc - s->conns, last;
+
+    if (s->status[x] != STATUS_NONE) {
+        s->tp->close(s->tp_ctx, x, s->cfg.teardown == CSCAN_TEARDOWN_RST);
+        // the last busy slot takes this one's place in the list
+        last = s->active[--s->st.inflight];
+        s->active[s->active_pos[x]] = last;
+        s->active_pos[last] = s->active_pos[x];
+        s->status[x] = STATUS_NONE;
+        // slots above a lowered limit are left to drain
+        if (x < s->cfg.sockets) s->free_slots[s->free_nr++] = x;
+    }
+    sc->tries = 0;
+    sc->ip = 0;
+    sc->port = 0;
+    sc->rtt_us = 0;
+}
+
+// bind sock to a source address, leaving the port to connect()
+static int bind_source(int sock, uint32_t ip) {
+    struct sockaddr_in saddr;
+    int one = 1;
+
+    // without this bind() reserves a port for every possible destination
+    setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = htonl(ip);
+    return bind(sock, (struct sockaddr *)&saddr, sizeof(saddr));
+}
+
+// number of local ports connect() may pick from
+static unsigned long ephemeral_ports(void) {
+    FILE *fp = fopen("/proc/sys/net/ipv4/ip_local_port_range", "r");
+    unsigned long lo = 32768, hi = 60999;
+
+    if (fp) {
+        if (fscanf(fp, "%lu %lu", &lo, &hi) != 2) lo = 32768, hi = 60999;
+        fclose(fp);
+    }
+    return hi - lo + 1;
+}
+
+// system wide TCP sockets in use and in TIME_WAIT, from /proc/net/sockstat
+static int sockstat(unsigned long *inuse, unsigned long *tw) {
+    FILE *fp = fopen("/proc/net/sockstat", "r");
+    char line[256];
+    int ret = -1;
+
+    if (!fp) return -1;
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "TCP: inuse %lu orphan %*u tw %lu", inuse, tw) == 2) {
+            ret = 0;
+            break;
+        }
+    fclose(fp);
+    return ret;
+}
+
+// sample TIME_WAIT and local port usage
+static void port_stats(cscan_t *s) {
+    if (sockstat(&s->st.inuse, &s->st.tw) == -1) return;
+    if (s->st.tw > s->st.peak_tw) s->st.peak_tw = s->st.tw;
+    if (s->st.inuse > s->st.peak_inuse) s->st.peak_inuse = s->st.inuse;
+}
+
+/*
+ * Socket transport: one non-blocking socket per slot, connections that
+ * finish show up as writable on an epoll fd.
+ */
+struct sock_transport {
+    int epfd;
+    int socks[CSCAN_MAX_SOCKS];
+    unsigned int user_timeout; // ms the kernel gives a connect, 0 = no limit
+    int busy_poll;             // SO_BUSY_POLL us, 0 = off
+    int syncnt;                // SYN retransmits that cover user_timeout
+};
+
+static int sock_connect(void *ctx, unsigned int slot, uint32_t ip,
+                        unsigned int port, uint32_t src) {
+    struct sock_transport *t = ctx;
+    struct sockaddr_in caddr;
+    struct epoll_event ev;
+    int sock, err;
+
+    // create socket
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock == -1) return -1;
+
+    // pick the source address, the local port is chosen at connect time
+    if (src && (bind_source(sock, src) == -1)) goto fail;
+
+    // poll the device queue for the answer instead of waiting for an irq,
+    // needs CAP_NET_ADMIN above net.core.busy_read, best effort
+    if (t->busy_poll)
+        setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &t->busy_poll,
+                   sizeof(t->busy_poll));
+
+    // let the kernel fail the connect with ETIMEDOUT in time
+    if (t->user_timeout) {
+        setsockopt(sock, IPPROTO_TCP, TCP_SYNCNT, &t->syncnt,
+                   sizeof(t->syncnt));
+        setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &t->user_timeout,
+                   sizeof(t->user_timeout));
+    }
+
+    // connect to given host, completion shows up as writable on epfd
+    memset(&caddr, 0, sizeof(caddr));
+    caddr.sin_family = AF_INET;
+    caddr.sin_addr.s_addr = htonl(ip);
+    caddr.sin_port = htons((unsigned short)port);
+    connect(sock, (struct sockaddr *)&caddr, sizeof(caddr));
+    ev.events = EPOLLOUT;
+    ev.data.u32 = slot;
+    if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, sock, &ev) == -1) goto fail;
+    t->socks[slot] = sock;
+    return 0;
+
+fail:
+    err = errno;
+    close(sock);
+    errno = err;
+    return -1;
+}
+
+static int sock_poll(void *ctx, struct cscan_completion *done, int max) {
+    struct sock_transport *t = ctx;
+    struct epoll_event evs[EVENTS_NR];
+    socklen_t len;
+    int n, i, nr = 0, err;
+
+    n = epoll_wait(t->epfd, evs, (max < EVENTS_NR) ? max : EVENTS_NR, 0);
+    for (i = 0; i < n; i++) {
+        err = 0;
+        len = sizeof(err);
+        if (getsockopt(t->socks[evs[i].data.u32], SOL_SOCKET, SO_ERROR, &err,
+                       &len) == -1)
+            err = errno;
+        if ((err == EINPROGRESS) || (err == EALREADY)) continue;
+        done[nr].slot = evs[i].data.u32;
+        done[nr++].err = err;
+    }
+    return nr;
+}
+
+static void sock_close(void *ctx, unsigned int slot, int rst) {
+    struct sock_transport *t = ctx;
+    struct linger lin = {1, 0};
+
+    if (t->socks[slot] == -1) return;
+    if (rst) {
+        // abortive close, no TIME_WAIT left behind on our side
+        setsockopt(t->socks[slot], SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+    } else
+        shutdown(t->socks[slot], SHUT_RDWR);
+    close(t->socks[slot]);
+    t->socks[slot] = -1;
+}
+
+static unsigned long sock_now(void *ctx) { return now_ms(); }
+
+static int sock_fd(void *ctx) { return ((struct sock_transport *)ctx)->epfd; }
+
+static void sock_free(void *ctx) {
+    struct sock_transport *t = ctx;
+    int x;
+
+    for (x = 0; x < CSCAN_MAX_SOCKS; x++) sock_close(t, x, 0);
+    close(t->epfd);
+    free(t);
+}
+
+static int sock_watch(void *ctx, unsigned int slot, int read) {
+    struct sock_transport *t = ctx;
+    struct epoll_event ev;
+
+    ev.events = read ? EPOLLIN : EPOLLOUT;
+    ev.data.u32 = slot;
+    return epoll_ctl(t->epfd, EPOLL_CTL_MOD, t->socks[slot], &ev);
+}
+
+static ssize_t sock_send(void *ctx, unsigned int slot, const void *buf,
+                         size_t len) {
+    return send(((struct sock_transport *)ctx)->socks[slot], buf, len,
+                MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static ssize_t sock_recv(void *ctx, unsigned int slot, void *buf, size_t len) {
+    return recv(((struct sock_transport *)ctx)->socks[slot], buf, len,
+                MSG_DONTWAIT);
+}
+
+static const struct cscan_transport sock_ops = {
+    sock_connect, sock_poll, sock_close, sock_now,
+    sock_fd,      sock_free, sock_watch, sock_send, sock_recv};
+
+static struct sock_transport *sock_new(void) {
+    struct sock_transport *t;
+    int x;
+
+    if (!(t = calloc(1, sizeof(*t)))) return NULL;
+    if ((t->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        free(t);
+        return NULL;
+    }
+    for (x = 0; x < CSCAN_MAX_SOCKS; x++) t->socks[x] = -1;
+    return t;
+}
+
+/*
+ * Clock for RTTs. Sockets get the raw hardware clock, which NTP does not
+ * slew; other transports only have their own clock, in ms.
+ */
+static unsigned long clock_us(cscan_t *s) {
+    struct timespec ts;
+
+    if (s->tp != &sock_ops) return clock_ms(s) * 1000;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static int connect_to(cscan_t *s, struct connection *sc) {
+    uint32_t src = 0;
+
+    if (s->sources_nr) {
+        src = s->sources[s->source_rr];
+        if (++s->source_rr >= s->sources_nr) s->source_rr = 0;
+    }
+    sc->sent_us = clock_us(s);
+    if (s->tp->connect(s->tp_ctx, sc - s->conns, sc->ip, sc->port, src) == -1)
+        return set_error(s, "Cannot start probe: %s", strerror(errno));
+    slot_start(s, sc - s->conns);
+
+    return 0;
+}
+
+// give up on a probe that timed out, maybe give it another go later
+static void timeout_sock(cscan_t *s, struct connection *sc) {
+    // the port answered, the service just did not finish talking
+    if (s->status[sc - s->conns] == STATUS_TALKING) {
+        report(s, sc, CSCAN_OPEN, s->coros[sc - s->conns].info);
+        clean_struct(s, sc);
+        return;
+    }
+    host_done(s, sc->ip, 0);
+    if ((sc->tries >= s->cfg.retries) ||
+        (retry_add(s, sc->ip, sc->port, sc->target, sc->tries + 1) == -1)) {
+        if (sc->tries) s->st.retries_exhausted++;
+        report(s, sc, CSCAN_FILTERED, NULL);
+    }
+    clean_struct(s, sc);
+}
+
+#define CO_WAIT 0
+#define CO_DONE 1
+
+#define CO_BEGIN(co) switch ((co)->line) { case 0:
+#define CO_END(co) } return CO_DONE
+// give up the slot until it is readable, then continue right here
+#define CO_YIELD(co)                                                           \
+    do {                                                                       \
+        (co)->line = __LINE__;                                                 \
+        return CO_WAIT;                                                        \
+    case __LINE__:;                                                            \
+    } while (0)
+// wait until buf holds a whole line, bail out on EOF or errors
+#define CO_READ_LINE(s, sc, co)                                                \
+    while (!co_has_line(co)) {                                                 \
+        CO_YIELD(co);                                                          \
+        if (co_fill(s, sc, co) <= 0) return CO_DONE;                           \
+    }
+
+// probe flags
+#define CO_STARTTLS 1 // the server offers STARTTLS
+#define CO_FOLLOW 2   // the redirect is followed
+
+static int co_has_line(struct coro *co) {
+    return memchr(co->buf, '\n', co->len) || (co->len == CO_BUF_SIZE);
+}
+
+// read what the slot has into buf
+static int co_fill(cscan_t *s, struct connection *sc, struct coro *co) {
+    ssize_t n;
+
+    if (co->len == CO_BUF_SIZE) return 1;
+    n = s->tp->recv(s->tp_ctx, sc - s->conns, co->buf + co->len,
+                    CO_BUF_SIZE - co->len);
+    if (n > 0) co->len += n;
+    return (n < 0 && errno == EAGAIN) ? 1 : n;
+}
+
+// drop the first line of buf, keeping a printable copy in line
+static void co_take_line(struct coro *co, char *line, size_t size) {
+    char *nl = memchr(co->buf, '\n', co->len);
+    size_t n = nl ? (size_t)(nl - co->buf) + 1 : co->len, i, j = 0;
+
+    for (i = 0; (i < n) && (j + 1 < size); i++) {
+        if ((co->buf[i] == '\r') || (co->buf[i] == '\n')) continue;
+        line[j++] = ((co->buf[i] < 32) || (co->buf[i] > 126)) ? '.' : co->buf[i];
+    }
+    line[j] = 0;
+    co->len -= n;
+    memmove(co->buf, co->buf + n, co->len);
+}
+
+static void co_send(cscan_t *s, struct connection *sc, const char *msg) {
+    // a few bytes on a fresh connection, the socket buffer takes them
+    s->tp->send(s->tp_ctx, sc - s->conns, msg, strlen(msg));
+}
+
+// first line the service sends
+static int probe_banner(cscan_t *s, struct connection *sc, struct coro *co) {
+    CO_BEGIN(co);
+    CO_READ_LINE(s, sc, co);
+    co_take_line(co, co->info, sizeof(co->info));
+    CO_END(co);
+}
+
+// SMTP greeting, EHLO and STARTTLS if the server offers it
+static int probe_smtp(cscan_t *s, struct connection *sc, struct coro *co) {
+    char line[CO_INFO_SIZE];
+    size_t n;
+
+    CO_BEGIN(co);
+    // greeting, possibly multi-line: 220-... until 220 ...
+    do {
+        CO_READ_LINE(s, sc, co);
+        co_take_line(co, co->info, 64);
+    } while ((strlen(co->info) > 3) && (co->info[3] == '-'));
+    if (strncmp(co->info, "220", 3)) return CO_DONE;
+
+    co_send(s, sc, "EHLO cscan\r\n");
+    do {
+        CO_READ_LINE(s, sc, co);
+        co_take_line(co, line, sizeof(line));
+        n = strlen(line);
+        if ((n > 4) && !strncasecmp(line + 4, "STARTTLS", 8))
+            co->flags |= CO_STARTTLS;
+    } while ((n > 3) && (line[3] == '-'));
+    n = strlen(co->info);
+    if (!(co->flags & CO_STARTTLS)) {
+        snprintf(co->info + n, sizeof(co->info) - n, " | no STARTTLS");
+        return CO_DONE;
+    }
+
+    co_send(s, sc, "STARTTLS\r\n");
+    CO_READ_LINE(s, sc, co);
+    co_take_line(co, line, sizeof(line));
+    n = strlen(co->info);
+    snprintf(co->info + n, sizeof(co->info) - n, " | STARTTLS %.40s", line);
+    CO_END(co);
+}
+
+// the status code and text of an HTTP status line, NULL if it is none
+static const char *http_status(const char *line) {
+    if (strncmp(line, "HTTP/", 5) || (strlen(line) < 12) || (line[8] != ' '))
+        return NULL;
+    return line + 9;
+}
+
+// the path a redirect leads to when that is on the probed ip:port, the
+// URL either relative to it or http://ip[:port]/...; NULL if elsewhere
+static const char *http_local_path(struct connection *sc, const char *loc) {
+    char host[16];
+    unsigned long port = 80;
+    size_t n, len;
+    char *end;
+
+    if (!strncasecmp(loc, "http://", 7)) loc += 5;
+    if (strncmp(loc, "//", 2)) return (*loc == '/') ? loc : NULL;
+    loc += 2;
+    len = strcspn(loc, "/?#");
+    n = snprintf(host, sizeof(host), "%u.%u.%u.%u", sc->ip >> 24,
+                 (sc->ip >> 16) & 0xff, (sc->ip >> 8) & 0xff, sc->ip & 0xff);
+    if ((len < n) || strncmp(loc, host, n)) return NULL;
+    if (len > n) {
+        if (loc[n] != ':') return NULL;
+        port = strtoul(loc + n + 1, &end, 10);
+        if (end != loc + len) return NULL;
+    }
+    if (port != sc->port) return NULL;
+    loc += len;
+    return (*loc == '/') ? loc : (*loc ? NULL : "/");
+}
+
+/*
+ * HTTP status of /, and when that is a redirect to a path on the same
+ * ip:port, the status of the second request on the same connection.
+ */
+static int probe_http(cscan_t *s, struct connection *sc, struct coro *co) {
+    char line[CO_BUF_SIZE], req[CO_PATH_SIZE + 96], *loc;
+    const char *path, *status;
+    size_t n;
+
+    CO_BEGIN(co);
+    snprintf(req, sizeof(req),
+             "GET / HTTP/1.1\r\nHost: %u.%u.%u.%u\r\nUser-Agent: cscan\r\n\r\n",
+             sc->ip >> 24, (sc->ip >> 16) & 0xff, (sc->ip >> 8) & 0xff,
+             sc->ip & 0xff);
+    co_send(s, sc, req);
+    CO_READ_LINE(s, sc, co);
+    co_take_line(co, co->info, 64);
+    if (!(status = http_status(co->info)) || (*status != '3')) return CO_DONE;
+
+    // headers: remember the body length and where we are sent
+    co->skip = 0;
+    co->has_len = 0;
+    for (;;) {
+        CO_READ_LINE(s, sc, co);
+        co_take_line(co, line, sizeof(line));
+        if (!*line) break;
+        if (!strncasecmp(line, "Content-Length:", 15)) {
+            co->skip = strtoul(line + 15, NULL, 10);
+            co->has_len = 1;
+        }
+        else if (!strncasecmp(line, "Location:", 9)) {
+            loc = line + 9 + strspn(line + 9, " ");
+            n = strlen(co->info);
+            snprintf(co->info + n, sizeof(co->info) - n, " -> %.48s", loc);
+            // only paths on this ip:port are followed, and only whole
+            path = http_local_path(sc, loc);
+            if (path && (strlen(path) < sizeof(co->path)) &&
+                !strchr(path, ' ')) {
+                strcpy(co->path, path);
+                co->flags |= CO_FOLLOW;
+            } else
+                co->flags &= ~CO_FOLLOW;
+        }
+    }
+    // without a length the body runs to the close, nothing to follow on
+    if (!(co->flags & CO_FOLLOW) || !co->has_len) return CO_DONE;
+
+    // discard the redirect's body, then ask again on the same connection
+    while (co->skip) {
+        n = (co->skip < co->len) ? co->skip : co->len;
+        co->skip -= n;
+        co->len -= n;
+        memmove(co->buf, co->buf + n, co->len);
+        if (!co->skip) break;
+        CO_YIELD(co);
+        if (co_fill(s, sc, co) <= 0) return CO_DONE;
+    }
+    snprintf(req, sizeof(req),
+             "GET %s HTTP/1.1\r\nHost: %u.%u.%u.%u\r\nUser-Agent: cscan\r\n\r\n",
+             co->path, sc->ip >> 24, (sc->ip >> 16) & 0xff, (sc->ip >> 8) & 0xff,
+             sc->ip & 0xff);
+    co_send(s, sc, req);
+    CO_READ_LINE(s, sc, co);
+    co_take_line(co, line, sizeof(line));
+    if (!(status = http_status(line))) return CO_DONE;
+    n = strlen(co->info);
+    snprintf(co->info + n, sizeof(co->info) - n, " %.16s", status);
+    CO_END(co);
+}
+
+// run the slot's probe until it waits or is done, report once done
+static void probe_resume(cscan_t *s, struct connection *sc, int err) {
+    struct coro *co = &s->coros[sc - s->conns];
+    int ret = CO_DONE;
+
+    if (!err) {
+        switch (s->cfg.probe) {
+        case CSCAN_PROBE_BANNER: ret = probe_banner(s, sc, co); break;
+        case CSCAN_PROBE_SMTP: ret = probe_smtp(s, sc, co); break;
+        case CSCAN_PROBE_HTTP: ret = probe_http(s, sc, co); break;
+        }
+    }
+    if (ret == CO_WAIT) return;
+    report(s, sc, CSCAN_OPEN, co->info);
+    clean_struct(s, sc);
+}
+
+// the port is open, start the application probe on it
+static void probe_start(cscan_t *s, struct connection *sc) {
+    struct coro *co = &s->coros[sc - s->conns];
+
+    memset(co, 0, offsetof(struct coro, buf));
+    co->info[0] = 0;
+    s->status[sc - s->conns] = STATUS_TALKING;
+    slot_due(s, sc - s->conns, s->cfg.timeout * 1000UL);
+    if (s->tp->watch(s->tp_ctx, sc - s->conns, 1) == -1) {
+        report(s, sc, CSCAN_OPEN, NULL);
+        clean_struct(s, sc);
+        return;
+    }
+    probe_resume(s, sc, 0);
+}
+
+// a probe finished with err, classify and report the result
+static void verif_sock(cscan_t *s, struct connection *sc, int err) {
+    int outcome;
+
+    if (s->status[sc - s->conns] == STATUS_TALKING) {
+        probe_resume(s, sc, err);
+        return;
+    }
+    if (s->status[sc - s->conns] != STATUS_CONNECTING) return;
+    // the kernel gave up on it, same as when our timer does
+    if (err == ETIMEDOUT) {
+        timeout_sock(s, sc);
+        return;
+    }
+
+    sc->rtt_us = s->collect_us - sc->sent_us;
+
+    switch (err) {
+    case 0: outcome = CSCAN_OPEN; break;
+    case EINPROGRESS:
+    case EALREADY: return;
+    case ECONNREFUSED: outcome = CSCAN_CLOSED; break;
+    case EHOSTUNREACH:
+    case ENETUNREACH: outcome = CSCAN_UNREACH; break;
+    default: outcome = CSCAN_ERROR; break;
+    }
+    host_done(s, sc->ip, (outcome == CSCAN_OPEN) || (outcome == CSCAN_CLOSED));
+    if (sc->tries && ((outcome == CSCAN_OPEN) || (outcome == CSCAN_CLOSED)))
+        s->st.retries_recovered++;
+    if ((outcome == CSCAN_OPEN) && s->coros) {
+        probe_start(s, sc);
+        return;
+    }
+    report(s, sc, outcome, NULL);
+    clean_struct(s, sc);
+}
+
+// collect every probe the transport finished since the last call
+static void collect(cscan_t *s) {
+    struct cscan_completion done[EVENTS_NR];
+    int n, i;
+
+    do {
+        n = s->tp->poll(s->tp_ctx, done, EVENTS_NR);
+        // one timestamp per batch, they all arrived by now
+        if (n) s->collect_us = clock_us(s);
+        for (i = 0; i < n; i++)
+            verif_sock(s, &s->conns[done[i].slot], done[i].err);
+    } while (n == EVENTS_NR);
+}
+
+static size_t align_up(size_t n, size_t to) { return (n + to - 1) & ~(to - 1); }
+
+// map size bytes, on huge pages if asked and the system has them
+static int arena_map(struct arena *a, size_t size, int huge) {
+    char *base;
+
+    memset(a, 0, sizeof(*a));
+    a->huge = CSCAN_HUGE_OFF;
+    if (!huge) {
+        a->size = size;
+        a->base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return (a->base == MAP_FAILED) ? -1 : 0;
+    }
+
+    // reserved huge pages first, they are never split or swapped
+    a->size = align_up(size, HUGE_PAGE_SIZE);
+    a->base = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (a->base != MAP_FAILED) {
+        a->huge = CSCAN_HUGE_TLB;
+        return 0;
+    }
+
+    // else transparent huge pages, which need 2M aligned memory
+    base = mmap(NULL, a->size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return -1;
+    a->base = (char *)align_up((uintptr_t)base, HUGE_PAGE_SIZE);
+    if (a->base > base) munmap(base, a->base - base);
+    munmap(a->base + a->size, base + HUGE_PAGE_SIZE - a->base);
+    if (!madvise(a->base, a->size, MADV_HUGEPAGE)) a->huge = CSCAN_HUGE_THP;
+    return 0;
+}
+
+// zeroed memory, lives as long as the arena
+static void *arena_alloc(struct arena *a, size_t size) {
+    void *p;
+
+    size = align_up(size, ARENA_ALIGN);
+    if (a->used + size > a->size) return NULL;
+    p = a->base + a->used;
+    a->used += size;
+    return p;
+}
+
+void cscan_config_init(struct cscan_config *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->timeout = 5;
+    cfg->sockets = 256;
+    cfg->backoff = 500;
+    cfg->teardown = CSCAN_TEARDOWN_CLOSE;
+    cfg->shard_nr = 1;
+}
+
+cscan_t *cscan_new(const struct cscan_config *cfg) {
+    struct arena a;
+    size_t size;
+    cscan_t *s;
+    int x;
+
+    if ((cfg->sockets < 1) || (cfg->sockets > CSCAN_MAX_SOCKS) ||
+        (cfg->retries > CSCAN_MAX_RETRIES) || !cfg->shard_nr ||
+        (cfg->shard_idx >= cfg->shard_nr) || (cfg->probe < 0) ||
+        (cfg->probe > CSCAN_PROBE_SMTP)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size = align_up(sizeof(*s), ARENA_ALIGN);
+    if (cfg->probe)
+        size += align_up(CSCAN_MAX_SOCKS * sizeof(struct coro), ARENA_ALIGN);
+    if (arena_map(&a, size, cfg->huge_pages) == -1) return NULL;
+    s = arena_alloc(&a, sizeof(*s));
+    if (cfg->probe)
+        s->coros = arena_alloc(&a, CSCAN_MAX_SOCKS * sizeof(struct coro));
+    s->arena = a;
+    if (!(s->tp_ctx = sock_new())) {
+        munmap(a.base, a.size);
+        return NULL;
+    }
+    s->st.allocs = 1;
+    if (cfg->kernel_timeout) {
+        s->ktimeout = 1;
+        ((struct sock_transport *)s->tp_ctx)->user_timeout = cfg->timeout * 1000;
+        // SYNs go out at 0, 1, 3, 7.. seconds, enough of them to reach it;
+        // the kernel takes at most 127, a 32 bit timeout stops x at 32
+        for (x = 1; (x < 127) && ((2ULL << x) - 1 < cfg->timeout); x++)
+            ;
+        ((struct sock_transport *)s->tp_ctx)->syncnt = x;
+    }
+    ((struct sock_transport *)s->tp_ctx)->busy_poll = cfg->busy_poll;
+    s->next_due = ULONG_MAX;
+    s->st.arena_size = a.size;
+    s->st.huge_pages = a.huge;
+    s->tp = &sock_ops;
+    s->cfg = *cfg;
+    atomic_init(&s->want_rate, cfg->rate);
+    atomic_init(&s->want_sockets, cfg->sockets);
+    atomic_init(&s->want_pause, 0);
+    for (x = 0; x < CSCAN_MAX_SOCKS; x++) s->status[x] = STATUS_NONE;
+    slots_reset(s);
+    s->st.ephemeral_ports = s->st.local_ports = ephemeral_ports();
+    s->stats_time = clock_ms(s);
+    return s;
+}
+
+void cscan_free(cscan_t *s) {
+    struct arena a;
+    unsigned int i;
+
+    if (!s) return;
+    while (s->st.inflight) clean_struct(s, &s->conns[s->active[0]]);
+    s->tp->free(s->tp_ctx);
+    free(s->targets);
+    if (s->alive) {
+        for (i = 0; i < 65536; i++) free(s->alive[i]);
+        free(s->alive);
+    }
+    a = s->arena;
+    munmap(a.base, a.size);
+}
+
+const char *cscan_error(cscan_t *s) { return s->err; }
+
+int cscan_parse_hosts(const char *hosts, uint32_t *first, uint32_t *last) {
+    char buf[64], *slash;
+    unsigned long mask = 0xffffffff, bits = 32;
+    struct in_addr addr;
+
+    snprintf(buf, sizeof(buf), "%s", hosts);
+    if ((slash = strchr(buf, '/'))) {
+        *slash++ = 0;
+        bits = atol(slash);
+    }
+    if (!inet_aton(buf, &addr) || (bits > 32)) return -1;
+    mask <<= (32 - bits);
+    *first = ntohl(addr.s_addr);
+    *last = (*first | ~mask) & 0xffffffff;
+    return 0;
+}
+
+int cscan_parse_ports(const char *ports, unsigned int *first,
+                      unsigned int *last) {
+    const char *dash = strchr(ports, '-');
+
+    *first = atol(ports);
+    *last = dash ? atol(dash + 1) : *first;
+    if ((*first < 1) || (*first > *last) || (*last > 65534)) return -1;
+    return 0;
+}
+
+int cscan_add_target(cscan_t *s, uint32_t first_ip, uint32_t last_ip,
+                     unsigned int first_port, unsigned int last_port) {
+    return cscan_add_job(s, 0, first_ip, last_ip, first_port, last_port);
+}
+
+int cscan_add_job(cscan_t *s, unsigned long job, uint32_t first_ip,
+                  uint32_t last_ip, unsigned int first_port,
+                  unsigned int last_port) {
+    struct target *t;
+
+    if ((first_ip > last_ip) || (first_port < 1) ||
+        (first_port > last_port) || (last_port > 65534))
+        return set_error(s, "Invalid target range");
+    if (s->targets_nr == s->targets_max) {
+        t = realloc(s->targets, (s->targets_max ? s->targets_max * 2 : 16) *
+                                    sizeof(struct target));
+        if (!t) return set_error(s, "Cannot allocate memory");
+        s->targets = t;
+        s->targets_max = s->targets_max ? s->targets_max * 2 : 16;
+        s->st.allocs++;
+    }
+    t = &s->targets[s->targets_nr++];
+    t->first_ip = first_ip;
+    t->last_ip = last_ip;
+    t->first_port = first_port;
+    t->last_port = last_port;
+    t->job = job;
+    t->left = target_share(s, t);
+    s->st.total += t->left;
+    s->gen_done = 0;
+    if (!t->left && s->job_cb) s->job_cb(job, s->job_arg);
+    return 0;
+}
+
+// parse "ip[/n][,ip[/n]...]" into the source address list
+int cscan_add_sources(cscan_t *s, const char *list) {
+    char buf[1024], *tok, *save;
+    uint32_t ip, last;
+    int sock;
+
+    snprintf(buf, sizeof(buf), "%s", list);
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (cscan_parse_hosts(tok, &ip, &last) == -1)
+            return set_error(s, "Invalid source address `%s'", tok);
+        for (;; ip++) {
+            if (s->sources_nr == CSCAN_MAX_SOURCES)
+                return set_error(s, "Max source addresses is %u",
+                                 CSCAN_MAX_SOURCES);
+            // make sure the address is usable before starting
+            sock = socket(AF_INET, SOCK_STREAM, 0);
+            if ((sock == -1) || (bind_source(sock, ip) == -1)) {
+                set_error(s, "Cannot use source address %s: %s", tok,
+                          strerror(errno));
+                if (sock != -1) close(sock);
+                return -1;
+            }
+            close(sock);
+            s->sources[s->sources_nr++] = ip;
+            if (ip == last) break;
+        }
+    }
+    s->st.sources = s->sources_nr;
+    s->st.local_ports = s->st.ephemeral_ports * s->sources_nr;
+    return 0;
+}
+
+void cscan_set_callback(cscan_t *s, cscan_result_cb cb, void *arg) {
+    s->cb = cb;
+    s->cb_arg = arg;
+}
+
+void cscan_set_job_callback(cscan_t *s, cscan_job_cb cb, void *arg) {
+    s->job_cb = cb;
+    s->job_arg = arg;
+}
+
+int cscan_set_transport(cscan_t *s, const struct cscan_transport *t,
+                        void *ctx) {
+    if (s->st.started || s->st.inflight)
+        return set_error(s, "Transport already in use");
+    if (s->cfg.probe && !t->watch)
+        return set_error(s, "Transport cannot run application probes");
+    s->tp->free(s->tp_ctx);
+    s->tp = t;
+    s->tp_ctx = ctx;
+    s->ktimeout = 0; // only sockets know how
+    s->stats_time = clock_ms(s);
+    return 0;
+}
+
+int cscan_fd(cscan_t *s) { return s->tp->fd(s->tp_ctx); }
+
+/*
+ * The knobs below are plain atomic stores, the scanner picks them up at
+ * the start of its next step. They never wait on the scanner, so they can
+ * be called from any thread, e.g. one serving a control socket.
+ */
+void cscan_set_rate(cscan_t *s, unsigned int rate) {
+    atomic_store_explicit(&s->want_rate, rate, memory_order_relaxed);
+}
+
+int cscan_set_sockets(cscan_t *s, unsigned int sockets) {
+    if ((sockets < 1) || (sockets > CSCAN_MAX_SOCKS)) return -1;
+    atomic_store_explicit(&s->want_sockets, sockets, memory_order_relaxed);
+    return 0;
+}
+
+void cscan_pause(cscan_t *s, int pause) {
+    atomic_store_explicit(&s->want_pause, pause, memory_order_relaxed);
+}
+
+// pick up knob changes, returns the probes the rate limiter allows now
+static unsigned long apply_knobs(cscan_t *s, unsigned long now) {
+    unsigned int rate, sockets;
+
+    rate = atomic_load_explicit(&s->want_rate, memory_order_relaxed);
+    sockets = atomic_load_explicit(&s->want_sockets, memory_order_relaxed);
+    s->paused = atomic_load_explicit(&s->want_pause, memory_order_relaxed);
+    if (sockets != s->cfg.sockets) {
+        s->cfg.sockets = sockets;
+        slots_reset(s);
+    }
+    if (rate != s->cfg.rate) {
+        s->cfg.rate = rate;
+        s->rate_credit = RATE_UNIT;
+        s->rate_time = now;
+    }
+    if (!s->cfg.rate) return ULONG_MAX;
+
+    s->rate_credit += (now - s->rate_time) * s->cfg.rate;
+    s->rate_time = now;
+    if (s->rate_credit > (unsigned long)s->cfg.rate * RATE_BURST + RATE_UNIT)
+        s->rate_credit = (unsigned long)s->cfg.rate * RATE_BURST + RATE_UNIT;
+    return s->rate_credit / RATE_UNIT;
+}
+
+int cscan_step(cscan_t *s) {
+    struct connection *sc;
+    struct probe p;
+    unsigned long now, allowed;
+    unsigned int i, x;
+    int ret;
+
+    // finished probes first, then the ones that ran out of time
+    collect(s);
+    now = clock_ms(s);
+    allowed = apply_knobs(s, now);
+    // backwards, a timed out slot is replaced by one already looked at
+    if (now >= s->next_due) {
+        s->next_due = ULONG_MAX;
+        for (i = s->st.inflight; i--;) {
+            x = s->active[i];
+            if (now >= s->due[x])
+                timeout_sock(s, &s->conns[x]);
+            else if (s->due[x] < s->next_due)
+                s->next_due = s->due[x];
+        }
+    }
+
+    // keep an eye on TIME_WAIT and local port pressure
+    if ((s->tp == &sock_ops) &&
+        (now - s->stats_time >= STATS_INTERVAL * 1000)) {
+        port_stats(s);
+        s->stats_time = now;
+    }
+
+    while (!s->paused && allowed && s->free_nr) {
+        // the slot leaves the stack only once its probe started
+        sc = &s->conns[s->free_slots[s->free_nr - 1]];
+        if ((ret = next_probe(s, &p)) != 1) {
+            if (ret == -1) s->gen_done = 1;
+            break;
+        }
+        sc->ip = p.ip;
+        sc->port = p.port;
+        sc->target = p.target;
+        if (connect_to(s, sc) == -1) {
+            sc->ip = 0;
+            sc->port = 0;
+            s->held = p;
+            s->has_held = 1;
+            return -1;
+        }
+        s->free_nr--;
+        sc->tries = p.tries;
+        host_start(s, p.ip);
+        allowed--;
+        if (s->cfg.rate) s->rate_credit -= RATE_UNIT;
+        if (p.tries)
+            s->st.retries_sent++;
+        else
+            s->st.started++;
+    }
+    // all targets are settled, start the list over for new ones
+    if (s->gen_done && !s->st.inflight && !s->has_held && !retry_pending(s)) {
+        s->targets_nr = s->target_cur = 0;
+        s->target_open = 0;
+    }
+    return s->gen_done ? 0 : 1;
+}
+
+long cscan_next_timeout(cscan_t *s) {
+    unsigned long now = clock_ms(s), due, next = 0;
+    struct retry_queue *rq;
+    unsigned int x;
+
+    if (s->st.inflight && (s->next_due != ULONG_MAX)) next = s->next_due;
+    for (x = 0; x < s->cfg.retries; x++) {
+        rq = &s->retries[x];
+        if (!rq->len) continue;
+        // a due retry still queued waits for a slot or its host, and a
+        // probe finishing is what frees either, so it is no deadline
+        due = rq->q[rq->head].due;
+        if ((due <= now) && (!s->free_nr || s->paused ||
+                             !host_ready(s, rq->q[rq->head].ip)))
+            continue;
+        if (!next || (due < next)) next = due;
+    }
+    // waiting for the rate limiter to allow the next probe
+    if (s->cfg.rate && !s->gen_done && !s->paused &&
+        (s->rate_credit < RATE_UNIT)) {
+        due = now + (RATE_UNIT - s->rate_credit + s->cfg.rate - 1) / s->cfg.rate;
+        if (!next || (due < next)) next = due;
+    }
+    if (!next) return -1;
+    return (next > now) ? next - now : 0;
+}
+
+// check the remaining probes one last time and close them
+void cscan_finish(cscan_t *s) {
+    unsigned int x;
+
+    collect(s);
+    while (s->st.inflight) {
+        x = s->active[s->st.inflight - 1];
+        // open ports keep what their probe got so far
+        if (s->status[x] == STATUS_TALKING)
+            report(s, &s->conns[x], CSCAN_OPEN, s->coros[x].info);
+        clean_struct(s, &s->conns[x]);
+    }
+    if (s->tp == &sock_ops) port_stats(s);
+}
+
+void cscan_get_stats(cscan_t *s, struct cscan_stats *st) {
+    *st = s->st;
+    st->rate = s->cfg.rate;
+    st->sockets = s->cfg.sockets;
+    st->paused = s->paused;
+}
+
+const char *cscan_outcome_name(int outcome) {
+    if ((outcome < 0) || (outcome >= CSCAN_OUTCOME_NR)) return "unknown";
+    return outcome_names[outcome];
+}